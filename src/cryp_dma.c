@@ -0,0 +1,210 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "libcryp.h"
+#include "main.h"
+#include "handlers.h"
+#include "perf.h"
+#include "cryp_dma.h"
+
+/* max time allowed to a single CRYP DMA transfer before it is restarted */
+#define CRYP_DMA_TIMEOUT_MS 500
+
+typedef enum {
+    CRYP_DMA_OK = 0,
+    CRYP_DMA_ERROR,
+    CRYP_DMA_TIMEOUT,
+    CRYP_DMA_SYSERR
+} cryp_dma_status_t;
+
+/*
+ * Compute the AES-CTR counter block of the given offset in the crypto chunk.
+ * The key is reinjected by dfusmart on each crypto chunk boundary and the
+ * counter restarts from zero for each chunk, so the counter block is the
+ * index of the AES block within the chunk. The CRYP only increments the last
+ * 32 bits of the counter, which is enough for a 16 bits chunk size.
+ */
+static void ctr_iv_from_offset(uint32_t chunk_offset, uint8_t iv[16])
+{
+    uint32_t block = chunk_offset / 16;
+
+    memset(iv, 0, 16);
+    iv[12] = (block >> 24) & 0xff;
+    iv[13] = (block >> 16) & 0xff;
+    iv[14] = (block >> 8) & 0xff;
+    iv[15] = block & 0xff;
+}
+
+/* systick (ms) of the start of the current transfer */
+static uint64_t dma_start_time = 0;
+
+static cryp_dma_status_t cryp_dma_start(const uint8_t *in, uint8_t *out,
+                                     uint32_t len, uint32_t chunk_offset)
+{
+    uint8_t iv[16];
+
+    ctr_iv_from_offset(chunk_offset, iv);
+    cryp_init_user(KEY_128, iv, 16, AES_CTR, DECRYPT);
+
+    status_reg.dmain_fifo_err = status_reg.dmain_dm_err = status_reg.dmain_tr_err = false;
+    status_reg.dmaout_fifo_err = status_reg.dmaout_dm_err = status_reg.dmaout_tr_err = false;
+    status_reg.dmaout_done = status_reg.dmain_done = false;
+    cryp_do_dma(in, out, len, dma_in_desc, dma_out_desc);
+    if (sys_get_systick(&dma_start_time, PREC_MILLI) != SYS_E_DONE) {
+        printf("Error: unable to get systick value !\n");
+        return CRYP_DMA_SYSERR;
+    }
+
+    return CRYP_DMA_OK;
+}
+
+static cryp_dma_status_t cryp_dma_wait(void)
+{
+    uint64_t dma_curr_time;
+
+    while (status_reg.dmaout_done == false) {
+        if (sys_get_systick(&dma_curr_time, PREC_MILLI) != SYS_E_DONE) {
+            printf("Error: unable to get systick value !\n");
+            return CRYP_DMA_SYSERR;
+        }
+        if (status_reg.dmaout_fifo_err || status_reg.dmaout_dm_err || status_reg.dmaout_tr_err) {
+            cryp_flush_fifos();
+            return CRYP_DMA_ERROR;
+        }
+        if ((dma_curr_time - dma_start_time) > CRYP_DMA_TIMEOUT_MS) {
+            cryp_flush_fifos();
+            return CRYP_DMA_TIMEOUT;
+        }
+    }
+    cryp_wait_for_emtpy_fifos();
+
+    return CRYP_DMA_OK;
+}
+
+static cryp_dma_status_t cryp_dma_once(const uint8_t *in, uint8_t *out,
+                                    uint32_t len, uint32_t chunk_offset)
+{
+    cryp_dma_status_t status;
+
+    if ((status = cryp_dma_start(in, out, len, chunk_offset)) != CRYP_DMA_OK) {
+        return status;
+    }
+    return cryp_dma_wait();
+}
+
+bool cryp_dma_decrypt(const uint8_t *in, uint8_t *out, uint32_t len,
+                   uint32_t chunk_offset)
+{
+    cryp_dma_status_t status;
+
+    /* The transfer carries its own counter block: a DMA error or timeout
+     * only requires it to be started again */
+    while ((status = cryp_dma_once(in, out, len, chunk_offset)) != CRYP_DMA_OK) {
+        if (status == CRYP_DMA_SYSERR) {
+            return false;
+        }
+        /* In place decryption can't be replayed: the input may already
+         * have been overwritten */
+        if (in == out) {
+            printf("Error: CRYP DMA failure on in place decryption\n");
+            return false;
+        }
+        perf_add_transfer(len, true);
+    }
+
+    return true;
+}
+
+#ifdef CONFIG_APP_DFUCRYPTO_DMA_BENCH
+#define CRYP_DMA_BENCH_SIZE     4096
+#define CRYP_DMA_BENCH_ROUNDS   8
+
+/* scratch buffer of the benchmark: the DMA SHMs belong to the peers */
+static uint8_t bench_buf[CRYP_DMA_BENCH_SIZE] __attribute__((aligned(16)));
+
+bool cryp_dma_bench(void)
+{
+    cryp_dma_status_t status = CRYP_DMA_OK;
+    uint64_t start;
+    uint64_t end;
+    uint32_t errors;
+
+    for (uint32_t len = 256; len <= CRYP_DMA_BENCH_SIZE; len *= 4) {
+        errors = 0;
+        if (sys_get_systick(&start, PREC_CYCLE) != SYS_E_DONE) {
+            status = CRYP_DMA_SYSERR;
+            break;
+        }
+        for (uint8_t i = 0; i < CRYP_DMA_BENCH_ROUNDS; ++i) {
+            status = cryp_dma_once(bench_buf, bench_buf, len, 0);
+            if (status == CRYP_DMA_SYSERR) {
+                break;
+            }
+            if (status != CRYP_DMA_OK) {
+                errors++;
+            }
+        }
+        if ((status == CRYP_DMA_SYSERR) ||
+            (sys_get_systick(&end, PREC_CYCLE) != SYS_E_DONE)) {
+            status = CRYP_DMA_SYSERR;
+            break;
+        }
+        if (end == start) {
+            end++;
+        }
+        printf("[cryp] DMA of %d bytes: %d bytes/kcycle, %d errors out of %d\n", len,
+               (uint32_t)(((uint64_t)len * CRYP_DMA_BENCH_ROUNDS * 1000) / (end - start)),
+               errors, CRYP_DMA_BENCH_ROUNDS);
+    }
+    /* the buffer holds keystream of the current key */
+    memset(bench_buf, 0, sizeof(bench_buf));
+
+    return status != CRYP_DMA_SYSERR;
+}
+#endif
+
+#if defined(CONFIG_APP_DFUCRYPTO_DECOMP) || defined(CONFIG_APP_DFUCRYPTO_DELTA)
+bool cryp_dma_copy(uint8_t *in, uint8_t *out, uint32_t len)
+{
+    cryp_dma_status_t status;
+
+    /* the masking pass is in place, and can't be replayed */
+    if (cryp_dma_once(in, in, len, 0) != CRYP_DMA_OK) {
+        printf("Error: CRYP DMA failure while masking the flash buffer\n");
+        return false;
+    }
+    while ((status = cryp_dma_once(in, out, len, 0)) != CRYP_DMA_OK) {
+        if (status == CRYP_DMA_SYSERR) {
+            return false;
+        }
+        perf_add_transfer(len, true);
+    }
+
+    return true;
+}
+#endif
+
@@ -0,0 +1,67 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef CRYP_DMA_H_
+#define CRYP_DMA_H_
+
+#include "libc/types.h"
+#include "autoconf.h"
+
+extern uint32_t dma_in_desc;
+extern uint32_t dma_out_desc;
+
+/*
+ * AES-CTR decryption of a buffer through the CRYP DMA. chunk_offset is the
+ * offset of the buffer in the current crypto chunk, from which the counter
+ * block is derived. It must be aligned on the AES block size. DMA errors and
+ * timeouts are retried, except for in place decryptions (in == out), whose
+ * input may have been partially overwritten. Returns false on unrecoverable
+ * error.
+ */
+bool cryp_dma_decrypt(const uint8_t *in, uint8_t *out, uint32_t len,
+                      uint32_t chunk_offset);
+
+#ifdef CONFIG_APP_DFUCRYPTO_DMA_BENCH
+/*
+ * Measure the CRYP DMA throughput, with the DMA configuration of libcryp,
+ * on a scratch buffer in task RAM, for a few transfer sizes. The figures are
+ * printed in bytes per thousand cycles. The current key is used, the CRYP
+ * state is set again by each transfer of the data plane. Returns false on
+ * syscall error.
+ */
+bool cryp_dma_bench(void);
+#endif
+
+#if defined(CONFIG_APP_DFUCRYPTO_DECOMP) || defined(CONFIG_APP_DFUCRYPTO_DELTA)
+/*
+ * Move len bytes from the task buffer in into the DMA SHM out, which the CPU
+ * can't access. The CRYP is used as copy engine: in is first XORed in place
+ * with a CTR keystream, and then decrypted into out with the same keystream,
+ * using the current key. The content of in is lost. len must be a multiple
+ * of the AES block size. Returns false on unrecoverable error.
+ */
+bool cryp_dma_copy(uint8_t *in, uint8_t *out, uint32_t len);
+#endif
+
+#endif
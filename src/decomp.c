@@ -0,0 +1,121 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/string.h"
+#include "decomp.h"
+
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+
+enum decomp_state {
+    DECOMP_TAG = 0,         /* 1: literal, 0: backref */
+    DECOMP_LITERAL,
+    DECOMP_BR_INDEX,
+    DECOMP_BR_COUNT,
+    DECOMP_BR_OUTPUT
+};
+
+void decomp_init(decomp_ctx_t *ctx)
+{
+    /* the history is zero-initialized, as expected by the encoder */
+    memset(ctx, 0, sizeof(decomp_ctx_t));
+    ctx->state = DECOMP_TAG;
+}
+
+static inline void decomp_emit(decomp_ctx_t *ctx, uint8_t c, uint8_t *out)
+{
+    *out = c;
+    ctx->window[ctx->head & (DECOMP_WINDOW_SIZE - 1)] = c;
+    ctx->head++;
+}
+
+uint32_t decomp_run(decomp_ctx_t *ctx,
+                    const uint8_t *in, uint32_t in_len, uint32_t *consumed,
+                    uint8_t *out, uint32_t out_len)
+{
+    uint32_t pos = 0;
+    uint32_t produced = 0;
+    uint8_t bit;
+
+    while (produced < out_len) {
+        if (ctx->state == DECOMP_BR_OUTPUT) {
+            decomp_emit(ctx, ctx->window[(ctx->head - ctx->br_index) & (DECOMP_WINDOW_SIZE - 1)],
+                        &out[produced++]);
+            if (--ctx->br_count == 0) {
+                ctx->state = DECOMP_TAG;
+            }
+            continue;
+        }
+
+        /* every other state consumes one bit of input, MSB first */
+        if (ctx->bit_mask == 0) {
+            if (pos == in_len) {
+                break;
+            }
+            ctx->current_byte = in[pos++];
+            ctx->bit_mask = 0x80;
+        }
+        bit = (ctx->current_byte & ctx->bit_mask) ? 1 : 0;
+        ctx->bit_mask >>= 1;
+
+        if (ctx->state == DECOMP_TAG) {
+            ctx->state = bit ? DECOMP_LITERAL : DECOMP_BR_INDEX;
+            ctx->bits = 0;
+            ctx->bit_count = 0;
+            continue;
+        }
+
+        ctx->bits = (ctx->bits << 1) | bit;
+        ctx->bit_count++;
+
+        switch (ctx->state) {
+            case DECOMP_LITERAL:
+                if (ctx->bit_count == 8) {
+                    decomp_emit(ctx, (uint8_t)ctx->bits, &out[produced++]);
+                    ctx->state = DECOMP_TAG;
+                }
+                break;
+            case DECOMP_BR_INDEX:
+                if (ctx->bit_count == DECOMP_WINDOW_BITS) {
+                    ctx->br_index = ctx->bits + 1;
+                    ctx->bits = 0;
+                    ctx->bit_count = 0;
+                    ctx->state = DECOMP_BR_COUNT;
+                }
+                break;
+            case DECOMP_BR_COUNT:
+                if (ctx->bit_count == DECOMP_LOOKAHEAD_BITS) {
+                    ctx->br_count = ctx->bits + 1;
+                    ctx->state = DECOMP_BR_OUTPUT;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    *consumed = pos;
+    return produced;
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DECOMP_H_
+#define DECOMP_H_
+
+#include "libc/types.h"
+#include "autoconf.h"
+
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+
+/*
+ * Streaming LZSS decompressor, compatible with the heatshrink bitstream
+ * (window and lookahead sizes being set at build time). The whole state,
+ * including the history window, is held in the context so that no dynamic
+ * allocation is required and the decompression can be suspended at any
+ * point of the input or output stream.
+ */
+
+#define DECOMP_WINDOW_BITS      CONFIG_APP_DFUCRYPTO_DECOMP_WINDOW_BITS
+#define DECOMP_LOOKAHEAD_BITS   CONFIG_APP_DFUCRYPTO_DECOMP_LOOKAHEAD_BITS
+#define DECOMP_WINDOW_SIZE      (1 << DECOMP_WINDOW_BITS)
+
+typedef struct {
+    uint8_t  state;
+    uint8_t  bit_mask;      /* next bit to read in current_byte, 0 if none */
+    uint8_t  current_byte;
+    uint8_t  bit_count;     /* number of bits read for the current field */
+    uint16_t bits;          /* value of the current field */
+    uint16_t br_index;      /* current backref distance */
+    uint16_t br_count;      /* remaining bytes to copy for the current backref */
+    uint16_t head;          /* write position in the history window */
+    uint8_t  window[DECOMP_WINDOW_SIZE];
+} decomp_ctx_t;
+
+void decomp_init(decomp_ctx_t *ctx);
+
+/*
+ * Decompress from in to out, until either the input is consumed or the
+ * output is full. The number of consumed input bytes is set in consumed,
+ * the number of produced bytes is returned.
+ */
+uint32_t decomp_run(decomp_ctx_t *ctx,
+                    const uint8_t *in, uint32_t in_len, uint32_t *consumed,
+                    uint8_t *out, uint32_t out_len);
+
+#endif
+
+#endif
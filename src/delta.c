@@ -0,0 +1,103 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/string.h"
+#include "delta.h"
+
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+
+static inline uint32_t delta_get_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t delta_hdr_len(uint8_t op)
+{
+    switch (op) {
+        case DELTA_OP_COPY:
+            return 9;
+        case DELTA_OP_INSERT:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+void delta_init(delta_ctx_t *ctx)
+{
+    memset(ctx, 0, sizeof(delta_ctx_t));
+    ctx->op = DELTA_OP_NONE;
+}
+
+uint32_t delta_parse_op(delta_ctx_t *ctx, const uint8_t *in, uint32_t len)
+{
+    uint32_t pos = 0;
+    uint8_t expected;
+
+    while ((ctx->op == DELTA_OP_NONE) && (pos < len)) {
+        ctx->hdr[ctx->hdr_len++] = in[pos++];
+        expected = delta_hdr_len(ctx->hdr[0]);
+        if (expected == 0) {
+            ctx->error = true;
+            return pos;
+        }
+        if (ctx->hdr_len < expected) {
+            continue;
+        }
+        if (ctx->hdr[0] == DELTA_OP_COPY) {
+            ctx->src = delta_get_u32(&ctx->hdr[1]);
+            ctx->remaining = delta_get_u32(&ctx->hdr[5]);
+        } else {
+            ctx->remaining = delta_get_u32(&ctx->hdr[1]);
+        }
+        ctx->hdr_len = 0;
+        /* empty operations are simply skipped */
+        if (ctx->remaining != 0) {
+            ctx->op = ctx->hdr[0];
+        }
+    }
+
+    return pos;
+}
+
+void delta_op_advance(delta_ctx_t *ctx, uint32_t n)
+{
+    if (n > ctx->remaining) {
+        n = ctx->remaining;
+    }
+    ctx->remaining -= n;
+    if (ctx->op == DELTA_OP_COPY) {
+        ctx->src += n;
+    }
+    if (ctx->remaining == 0) {
+        ctx->op = DELTA_OP_NONE;
+    }
+}
+
+bool delta_is_idle(const delta_ctx_t *ctx)
+{
+    return (ctx->op == DELTA_OP_NONE) && (ctx->hdr_len == 0) && (ctx->error == false);
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef DELTA_H_
+#define DELTA_H_
+
+#include "libc/types.h"
+#include "autoconf.h"
+
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+
+/*
+ * Delta patch stream parser. Once decrypted, a delta image is a sequence of
+ * operations rebuilding the new firmware from the installed one:
+ *
+ *  - COPY:   [0x01][src offset: u32 LE][length: u32 LE]
+ *            copy length bytes of the installed firmware, from src offset
+ *  - INSERT: [0x02][length: u32 LE][length bytes of data]
+ *            insert the following length bytes of the patch
+ *
+ * Operations may span any number of write requests. The parser only decodes
+ * the operation headers, executing the operations is left to the caller.
+ */
+
+#define DELTA_OP_NONE    0x00
+#define DELTA_OP_COPY    0x01
+#define DELTA_OP_INSERT  0x02
+
+/* biggest operation header: op, src offset and length */
+#define DELTA_HDR_MAXLEN 9
+
+typedef struct {
+    uint8_t  op;            /* current operation, DELTA_OP_NONE if none */
+    uint32_t src;           /* COPY: next offset to read in the installed firmware */
+    uint32_t remaining;     /* bytes left to produce for the current operation */
+    uint8_t  hdr[DELTA_HDR_MAXLEN];
+    uint8_t  hdr_len;       /* bytes of the next operation header received so far */
+    bool     error;
+} delta_ctx_t;
+
+void delta_init(delta_ctx_t *ctx);
+
+/*
+ * Parse the next operation header from the patch stream. Returns the number
+ * of consumed bytes: parsing stops as soon as an operation is decoded (ctx->op
+ * is then set) or the input is exhausted. Malformed operations set ctx->error.
+ */
+uint32_t delta_parse_op(delta_ctx_t *ctx, const uint8_t *in, uint32_t len);
+
+/* Account for n bytes produced for the current operation */
+void delta_op_advance(delta_ctx_t *ctx, uint32_t n);
+
+/* true if the patch stream ended on an operation boundary */
+bool delta_is_idle(const delta_ctx_t *ctx);
+
+#endif
+
+#endif
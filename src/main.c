@@ -38,6 +38,10 @@
 #include "libcryp.h"
 #include "main.h"
 #include "handlers.h"
+#include "perf.h"
+#include "cryp_dma.h"
+#include "decomp.h"
+#include "delta.h"
 #include "wookey_ipc.h"
 #include "autoconf.h"
 
@@ -49,58 +53,119 @@
 const char *tim = "tim";
 #endif
 
-static volatile uint16_t usb_chunk_size = 0;
-static volatile uint16_t flash_chunk_size = 0;
+/*
+ * The DFU peers dispatch the dfucrypto specific magics of main.h and the
+ * ones of wookey_ipc.h on the same field: never called, this switch fails
+ * to build (duplicate case value) if wookey_ipc.h gets a colliding magic.
+ */
+static inline void magic_collision_check(uint8_t magic)
+{
+    switch (magic) {
+        case MAGIC_TASK_STATE_CMD:
+        case MAGIC_TASK_STATE_RESP:
+        case MAGIC_CRYPTO_INJECT_CMD:
+        case MAGIC_CRYPTO_INJECT_RESP:
+        case MAGIC_AUTH_STATE_PASSED:
+        case MAGIC_DATA_RD_DMA_REQ:
+        case MAGIC_DATA_WR_DMA_REQ:
+        case MAGIC_DATA_WR_DMA_ACK:
+        case MAGIC_DFU_HEADER_SEND:
+        case MAGIC_DFU_HEADER_VALID:
+        case MAGIC_DFU_HEADER_INVALID:
+        case MAGIC_DFU_DWNLOAD_FINISHED:
+        case MAGIC_DFU_WRITE_FINISHED:
+        case MAGIC_REBOOT_REQUEST:
+        case MAGIC_INVALID:
+        case MAGIC_DFU_ERASE_AHEAD:
+        case MAGIC_DFU_BANK_READ:
+        case MAGIC_DFU_CHUNK_DIGEST:
+        case MAGIC_DFU_FLASH_DIGEST:
+        case MAGIC_DFU_FLASH_SKIP:
+        case MAGIC_DFU_FLASH_SECTOR:
+        default:
+            break;
+    }
+}
 
-static volatile uint16_t crypto_chunk_size = 0;
-static volatile uint32_t total_bytes_read = 0;
+/*
+ * DFU session context. A session is opened by the DFU header sent by dfuusb
+ * and lives until dfuflash has finished writing its image, so that the
+ * header of the next image can be validated while the previous one is being
+ * flushed.
+ */
+typedef enum {
+    DFU_SESSION_FREE = 0,
+    DFU_SESSION_HEADER_PENDING,     /* header under validation by dfusmart */
+    DFU_SESSION_ACTIVE,             /* image data being transferred */
+    DFU_SESSION_FLUSHING            /* EOF sent, waiting for dfuflash to finish */
+} dfu_session_state_t;
+
+#define DFU_SESSIONS_MAX 2
+
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+/* COPY operation of a delta image, pending in the flash buffer */
+#define DELTA_COPIES_MAX 8
+
+typedef struct {
+    uint32_t src;       /* offset in the installed firmware */
+    uint16_t offset;    /* offset in the flash buffer */
+    uint16_t len;
+} delta_copy_t;
+#endif
 
-static bool flash_ready = false;
-static bool usb_ready = false;
-static bool smart_ready = false;
+typedef struct {
+    dfu_session_state_t state;
+    /* opening order, dfuflash finishing the images in the same order */
+    uint32_t seq;
+    uint16_t crypto_chunk_size;
+    /* transfer size of dfuusb, checked against the image geometry */
+    uint16_t transfer_size;
+    uint32_t total_bytes_read;
+    /* total image size, as announced by dfusmart in the header validation
+     * (0 if unknown) */
+    uint32_t image_size;
+    /* DFU_HEADER_FLAG_* options of the image */
+    uint32_t header_flags;
+    /* bytes handed to dfuflash for the image */
+    uint32_t total_bytes_written;
+#ifdef CONFIG_APP_DFUCRYPTO_ERASE_AHEAD
+    /* end of the image area dfuflash has already been asked to erase */
+    uint32_t erase_ahead_offset;
+    /* end of the flash sector written to, when the hint was last renewed */
+    uint32_t erase_ahead_sector_end;
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED
+    /* end of the image area whose handling is decided, and whether it is
+     * already installed: its requests are then only acknowledged */
+    uint32_t skip_region_end;
+    bool skip_region;
+#endif
+} dfu_session_t;
 
-static bool chunk_sizes_sanity_check(void)
-{
-	/* We check that the DFU USB, crypto chunks and flash chunks are on par */
-
-	/* USB and flash chunk sizes must be equal */
-	if(usb_chunk_size != flash_chunk_size){
-		printf("Error: usb_chunk_size (%d) != flash_chunk_size (%d)\n", usb_chunk_size, flash_chunk_size);
-		goto err;
-	}
-
-	/* Crypto chunk size must be a multiple of the USB and flash chunk size */
-	if((crypto_chunk_size < usb_chunk_size) || (crypto_chunk_size < flash_chunk_size)){
-		printf("Error: crypto chunk size %d < usb and flash chunk size %d, %d\n", crypto_chunk_size, usb_chunk_size, flash_chunk_size);
-		goto err;
-	}
-	if((crypto_chunk_size % usb_chunk_size != 0) || (crypto_chunk_size % flash_chunk_size != 0)){
-		printf("Error: crypto chunk size %d is not a multiple of usb and flash chunk sizes %d, %d\n", usb_chunk_size, flash_chunk_size);
-		goto err;
-	}
-
-	return true;
+static dfu_session_t sessions[DFU_SESSIONS_MAX];
+static uint32_t session_seq = 0;
+/* session the data plane requests from dfuusb apply to */
+static dfu_session_t *session = &sessions[0];
 
-err:
-	return false;
-}
-
-static bool is_initial_chunk(void)
+/*
+ * Offset of the given image offset in its crypto chunk. As the key is
+ * reinjected and the CTR counter restarts on each crypto chunk, this is
+ * what the counter block is derived from.
+ */
+static uint32_t offset_in_chunk(uint32_t offset)
 {
-	if (total_bytes_read == 0){
-		return true;
-	}
-	else{
-		return false;
-	}
+    if (session->crypto_chunk_size == 0) {
+        return offset;
+    }
+    return offset % session->crypto_chunk_size;
 }
 
 static bool is_new_chunk(void)
 {
 #if CRYPTO_DEBUG
-    printf("total bytes read: %x, crypto_chunk_size: %x\n", total_bytes_read, crypto_chunk_size);
+    printf("total bytes read: %x, crypto_chunk_size: %x\n", session->total_bytes_read, session->crypto_chunk_size);
 #endif
-    if (total_bytes_read && total_bytes_read % crypto_chunk_size == 0)
+    if (session->total_bytes_read && session->total_bytes_read % session->crypto_chunk_size == 0)
     {
         return true;
     }
@@ -140,7 +205,6 @@ uint8_t id_pin   = 0;
 uint32_t dma_in_desc;
 uint32_t dma_out_desc;
 
-uint8_t master_key_hash[32] = {0};
 
 
 
@@ -161,296 +225,1165 @@ static void ask_reboot(void){
         }
 }
 
+#if defined(CONFIG_APP_DFUCRYPTO_ERASE_AHEAD) || defined(CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED)
 /*
- * We use the local -fno-stack-protector flag for main because
- * the stack protection has not been initialized yet.
- *
- * We use _main and not main to permit the usage of exactly *one* arg
- * without compiler complain. argc/argv is not a goot idea in term
- * of size and calculation in a microcontroler
+ * Send a request with the given magic and arguments to dest, and wait for its
+ * answer in cmd. valid is false if dest refused it. Returns false on IPC
+ * error.
  */
-int _main(uint32_t task_id)
+static bool peer_request(uint8_t dest, uint8_t magic, uint32_t arg0, uint32_t arg1,
+                         struct sync_command_data *cmd, bool *valid)
 {
-    char *wellcome_msg = "hello, I'm crypto";
-//    char buffer_in[128];
-    logsize_t size;
-    uint8_t id = 0;
-    char ipc_buf[32] = {0};
-    const char * inject_order = "INJECT";
-
-    struct sync_command      ipc_sync_cmd;
-    struct sync_command_data ipc_sync_cmd_data;
+    uint8_t id = dest;
+    logsize_t size = sizeof(struct sync_command_data);
+
+    *valid = false;
+    memset(cmd, 0, sizeof(struct sync_command_data));
+    cmd->magic = magic;
+    cmd->state = SYNC_WAIT;
+    cmd->data_size = 2 * sizeof(uint32_t);
+    cmd->data.u32[0] = arg0;
+    cmd->data.u32[1] = arg1;
+    if (sys_ipc(IPC_SEND_SYNC, dest, sizeof(struct sync_command_data), (const char*)cmd) != SYS_E_DONE) {
+        return false;
+    }
+    if (sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)cmd) != SYS_E_DONE) {
+        return false;
+    }
+    *valid = (cmd->magic == magic) && (cmd->state == SYNC_DONE);
 
-    strncpy(ipc_buf, inject_order, 6);
-#ifdef CONFIG_APP_CRYPTO_USE_GETCYCLES
-    device_t dev2;
-    memset(&dev2, 0, sizeof(device_t));
-    int      dev_descriptor = 0;
+    return true;
+}
 #endif
-    e_syscall_ret ret = 0;
 
-    /**
-     * Initialization sequence
-     */
-    printf("%s, my id is %x\n", wellcome_msg, task_id);
+#ifdef CONFIG_APP_DFUCRYPTO_ERASE_AHEAD
+/*
+ * End of the flash sector holding the given image offset, or 0 if dfuflash
+ * does not know it.
+ */
+static bool erase_ahead_sector(uint32_t offset, uint32_t *end)
+{
+    struct sync_command_data sector;
+    bool valid;
 
-#ifdef CONFIG_APP_CRYPTO_USE_GETCYCLES
-    strncpy(dev.name, tim, 3);
-    dev2.address = 0x40000020;
-    dev2.size = 0x20;
-    dev2.isr_ctx_only = false;
-    dev2.irq_num = 0;
-    dev2.gpio_num = 0;
+    *end = 0;
+    if (peer_request(id_dfuflash, MAGIC_DFU_FLASH_SECTOR, offset, 0, &sector, &valid) == false) {
+        return false;
+    }
+    if (valid && (sector.data.u32[0] <= offset) && (sector.data.u32[1] > offset - sector.data.u32[0])) {
+        *end = sector.data.u32[0] + sector.data.u32[1];
+    }
 
-    printf("registering %s driver\n", dev2.name);
-    if ((ret = sys_init(INIT_DEVACCESS, &dev2, &dev_descriptor)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    return true;
+}
+
+/*
+ * Ask dfuflash to erase the flash sectors following the one being written,
+ * so that their erase runs while dfuusb receives the next transfer, instead
+ * of inline on their first write. Called once dfuflash is idle, after a
+ * write request has been acknowledged to dfuusb: the hint is renewed each
+ * time the write position enters a new sector, so that the window is kept
+ * CONFIG_APP_DFUCRYPTO_ERASE_AHEAD_SECTORS sectors ahead of it. dfuflash
+ * does not respond to the hint.
+ */
+static bool erase_ahead(void)
+{
+    struct sync_command_data erase_cmd = { 0 };
+    uint32_t start = session->erase_ahead_offset;
+    uint32_t end;
+    uint8_t sectors = 1;
+
+    /* image_size is the size of the received image: the size of the
+     * decompressed or patched firmware is only known once it is written */
+    if (session->header_flags & DFU_HEADER_FLAGS_STAGED) {
+        return true;
+    }
+#ifdef CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED
+    /* an erased area may have been kept as is */
+    if (session->header_flags & DFU_HEADER_FLAG_DIGESTS) {
+        return true;
     }
 #endif
+    if (session->total_bytes_written < session->erase_ahead_sector_end) {
+        return true;
+    }
+    if (erase_ahead_sector(session->total_bytes_written, &session->erase_ahead_sector_end) == false) {
+        return false;
+    }
+    end = session->erase_ahead_sector_end;
+    /* first hint, or window overtaken: from the write position */
+    if (start <= session->total_bytes_written) {
+        start = session->total_bytes_written;
+        sectors = CONFIG_APP_DFUCRYPTO_ERASE_AHEAD_SECTORS;
+    } else {
+        end = start;
+    }
+    for (uint8_t i = 0; (i < sectors) && (end != 0); ++i) {
+        if ((session->image_size != 0) && (end >= session->image_size)) {
+            break;
+        }
+        if (erase_ahead_sector(end, &end) == false) {
+            return false;
+        }
+    }
+    if (end == 0) {
+        /* unknown layout: the sectors are erased on write */
+        session->erase_ahead_sector_end = 0xffffffff;
+        return true;
+    }
+    if ((session->image_size != 0) && (end > session->image_size)) {
+        end = session->image_size;
+    }
+    if (end <= start) {
+        return true;
+    }
 
-    if ((ret = sys_init(INIT_GETTASKID, "dfusmart", &id_smart)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    erase_cmd.magic = MAGIC_DFU_ERASE_AHEAD;
+    erase_cmd.state = SYNC_WAIT;
+    erase_cmd.data_size = 2 * sizeof(uint32_t);
+    erase_cmd.data.u32[0] = start;
+    erase_cmd.data.u32[1] = end - start;
+#if CRYPTO_DEBUG
+    printf("[write] erase ahead %x -> %x\n", start, end);
+#endif
+    if (sys_ipc(IPC_SEND_SYNC, id_dfuflash, sizeof(struct sync_command_data), (const char*)&erase_cmd) != SYS_E_DONE) {
+        printf("Error ! unable to send ERASE_AHEAD to flash!\n");
+        return false;
     }
-    printf("smart is task %x !\n", id_smart);
+    session->erase_ahead_offset = end;
 
-    if ((ret = sys_init(INIT_GETTASKID, "pin", &id_pin)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    return true;
+}
+#endif
+
+/*
+ * Chunk geometry check. The transfer size of dfuusb is its DMA SHM size,
+ * which follows the DFU wTransferSize given to the host at enumeration: it
+ * can't be changed for an image. The image is only accepted if this size
+ * fits in the flash DMA SHM, is a multiple of the AES block size and divides
+ * the crypto chunk size, so that no transfer crosses a key reinjection
+ * boundary. Returns the transfer size, or 0 if the image can't be handled.
+ */
+static uint16_t chunk_geometry_check(void)
+{
+    uint16_t size = shms_tab[ID_USB].size;
+
+    if ((session->crypto_chunk_size == 0) || (session->crypto_chunk_size % 16 != 0)) {
+        printf("Error: invalid crypto chunk size %d\n", session->crypto_chunk_size);
+        return 0;
     }
-    printf("pin is task %x !\n", id_pin);
+    if ((size == 0) || (size % 16 != 0) || (size > shms_tab[ID_FLASH].size) ||
+        (session->crypto_chunk_size % size != 0)) {
+        printf("Error: crypto chunk size %d is not a multiple of the usb chunk size %d (flash: %d)\n",
+                session->crypto_chunk_size, size, shms_tab[ID_FLASH].size);
+        return 0;
+    }
+#ifdef DFUCRYPTO_STAGING
+    /* transformed images go through the staging and flash buffers */
+    if ((session->header_flags & DFU_HEADER_FLAGS_STAGED) && (size > CONFIG_APP_DFUCRYPTO_STAGE_BUFSIZE)) {
+        printf("Error: usb chunk size %d overflows the staging buffers\n", size);
+        return 0;
+    }
+#endif
 
-    if ((ret = sys_init(INIT_GETTASKID, "dfuflash", &id_dfuflash)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    return size;
+}
+
+/*
+ * Ask dfuflash to write len bytes from its SHM, using the given write request
+ * as template, and wait for its acknowledge.
+ */
+static bool flash_write(const struct sync_command_data *req, uint16_t len,
+                     struct sync_command_data *ack)
+{
+    struct sync_command_data flash_req = *req;
+    uint8_t id = id_dfuflash;
+    logsize_t size = sizeof(struct sync_command_data);
+    uint64_t stage_start = perf_now();
+
+    flash_req.magic = MAGIC_DATA_WR_DMA_REQ;
+    flash_req.data.u16[0] = len;
+
+#if CRYPTO_DEBUG
+    printf("[write] sending ipc to flash (%d)\n", id_dfuflash);
+#endif
+    if (sys_ipc(IPC_SEND_SYNC, id_dfuflash, sizeof(struct sync_command_data), (const char*)&flash_req) != SYS_E_DONE) {
+        printf("Error ! unable to send DMA_WR_REQ to flash!\n");
+        return false;
     }
-    printf("sdio is task %x !\n", id_dfuflash);
+    /* wait for flash task acknowledge (IPC) */
+    if (sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)ack) != SYS_E_DONE) {
+        printf("Error ! unable to receive back DMA_WR_ACK from flash!\n");
+        return false;
+    }
+    perf_account(PERF_STAGE_FLASH_WRITE, stage_start);
+    session->total_bytes_written += len;
 
-    if ((ret = sys_init(INIT_GETTASKID, "dfuusb", &id_usb)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    return true;
+}
+
+#ifdef DFUCRYPTO_STAGING
+/*
+ * Staging buffer receiving the CRYP output when the decrypted data has to be
+ * transformed before being written to flash.
+ */
+static uint8_t stage_buf[CONFIG_APP_DFUCRYPTO_STAGE_BUFSIZE] __attribute__((aligned(16)));
+
+/*
+ * Flash buffer, where the transformed data is built by the CPU. The flash
+ * DMA SHM is only granted to us for DMA accesses: once full, the buffer is
+ * moved into it through the CRYP (see cryp_dma_copy()).
+ */
+static uint8_t flash_buf[CONFIG_APP_DFUCRYPTO_STAGE_BUFSIZE] __attribute__((aligned(16)));
+
+/*
+ * Transformation state of the image being received. As the buffers above,
+ * only the session receiving data uses it: it is reset when a session is
+ * opened, the image of a flushing session being already fully transformed.
+ */
+static struct {
+    /* transformed bytes pending in the flash buffer */
+    uint16_t flash_fill;
+    /* SYNC_DONE, or the failure state given back to dfuusb for all the
+     * following write requests once the image is known broken */
+    uint8_t stage_state;
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+    /* decompressor state, kept across the write requests of the image */
+    decomp_ctx_t decomp_ctx;
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+    /* patch parser state, kept across the write requests of the image */
+    delta_ctx_t delta_ctx;
+    /* COPY operations of the flash buffer, executed on its commit */
+    delta_copy_t delta_copies[DELTA_COPIES_MAX];
+    uint8_t delta_ncopies;
+#endif
+} stage_ctx;
+
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+/*
+ * Ask dfuflash to read len bytes of the installed firmware, from offset src,
+ * into its SHM at shm_offset. A refused read fails the image.
+ */
+static bool bank_read(uint32_t src, uint16_t shm_offset, uint32_t len)
+{
+    struct sync_command_data read_cmd = { 0 };
+    uint8_t id = id_dfuflash;
+    logsize_t size = sizeof(struct sync_command_data);
+
+    read_cmd.magic = MAGIC_DFU_BANK_READ;
+    read_cmd.state = SYNC_WAIT;
+    read_cmd.data_size = 3 * sizeof(uint32_t);
+    read_cmd.data.u32[0] = src;
+    read_cmd.data.u32[1] = shm_offset;
+    read_cmd.data.u32[2] = len;
+
+    if (sys_ipc(IPC_SEND_SYNC, id_dfuflash, sizeof(struct sync_command_data), (const char*)&read_cmd) != SYS_E_DONE) {
+        printf("Error ! unable to send BANK_READ to flash!\n");
+        return false;
     }
-    printf("usb is task %x !\n", id_usb);
+    if (sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&read_cmd) != SYS_E_DONE) {
+        printf("Error ! unable to receive back BANK_READ from flash!\n");
+        return false;
+    }
+    if ((read_cmd.magic != MAGIC_DFU_BANK_READ) || (read_cmd.state != SYNC_DONE)) {
+        printf("Error: flash refused to read %d bytes at %x\n", len, src);
+        stage_ctx.stage_state = SYNC_FAILURE;
+    }
+    return true;
+}
+#endif
 
-    cryp_early_init(true, CRYP_MAP_AUTO, CRYP_USER, (int*) &dma_in_desc, (int*) &dma_out_desc);
+/*
+ * Hand the pending bytes of the flash buffer to dfuflash once it is full, or
+ * as soon as it is not empty if force is set. The buffer is moved to the
+ * flash SHM, the pending COPY operations are then executed by dfuflash in its
+ * SHM, and the flash write is requested. A failed flash write fails the
+ * image.
+ */
+static bool flash_fill_commit(bool force)
+{
+    struct sync_command_data flash_req = { 0 };
+    struct sync_command_data ack;
+    uint64_t stage_start;
 
-    printf("set init as done\n");
-    if ((ret = sys_init(INIT_DONE)) != SYS_E_DONE) {
-        printf("sys_init returns %s !\n", strerror(ret));
-        goto err_init;
+    if ((stage_ctx.flash_fill != session->transfer_size) && !(force && (stage_ctx.flash_fill != 0))) {
+        return true;
     }
-    printf("sys_init returns %s !\n", strerror(ret));
+    stage_start = perf_now();
+    /* moved in whole AES blocks, the transfer size being a multiple of them */
+    if (cryp_dma_copy(flash_buf, (uint8_t *)shms_tab[ID_FLASH].address,
+                      (stage_ctx.flash_fill + 15) & ~0xfUL) == false) {
+        return false;
+    }
+    perf_account(PERF_STAGE_CRYP_DMA, stage_start);
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+    for (uint8_t i = 0; i < stage_ctx.delta_ncopies; ++i) {
+        if (bank_read(stage_ctx.delta_copies[i].src, stage_ctx.delta_copies[i].offset,
+                      stage_ctx.delta_copies[i].len) == false) {
+            return false;
+        }
+    }
+    stage_ctx.delta_ncopies = 0;
+#endif
+    if (stage_ctx.stage_state == SYNC_DONE) {
+        flash_req.state = SYNC_WAIT;
+        flash_req.data_size = sizeof(uint16_t);
+        if (flash_write(&flash_req, stage_ctx.flash_fill, &ack) == false) {
+            return false;
+        }
+        if (ack.state != SYNC_DONE) {
+            printf("Error: flash write failure (%x)\n", ack.state);
+            stage_ctx.stage_state = ack.state;
+        }
+    }
+    stage_ctx.flash_fill = 0;
+
+    return true;
+}
+
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+/*
+ * Decompress the given decrypted data into the flash buffer. An empty input
+ * drains the decompressor, at the end of the image.
+ */
+static bool decompress_to_flash(const uint8_t *in, uint32_t len)
+{
+    uint32_t used = 0;
+    uint32_t consumed;
+    uint32_t produced;
 
-    /*******************************************
-     * let's synchronize with other tasks
-     *******************************************/
     do {
-        size = sizeof(struct sync_command);
+        produced = decomp_run(&stage_ctx.decomp_ctx, in + used, len - used, &consumed,
+                              flash_buf + stage_ctx.flash_fill, session->transfer_size - stage_ctx.flash_fill);
+        used += consumed;
+        stage_ctx.flash_fill += produced;
+        if (flash_fill_commit(false) == false) {
+            return false;
+        }
+    } while ((stage_ctx.stage_state == SYNC_DONE) &&
+             ((used < len) || ((len == 0) && (produced != 0))));
 
-        /*
-         * CRYPTO is a central node, it waits for mostly all tasks
-         * (usb, sdio & smart), in any order
-         */
-        id = ANY_APP;
-        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd);
-        if (ret != SYS_E_DONE) {
-            /* defensive programing, should not append as there is no
-             * asynchronous IPC in this task */
+    return true;
+}
+#endif
+
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+/*
+ * Apply the given decrypted patch data, rebuilding the new firmware into the
+ * flash buffer: INSERT data is copied from the patch, COPY operations are
+ * recorded and executed by dfuflash, which reads the installed firmware
+ * directly at their place in its SHM. An empty input checks that the patch
+ * ended on an operation boundary, after the pending COPY has been executed.
+ * A malformed patch fails the image.
+ */
+static bool delta_to_flash(const uint8_t *in, uint32_t len)
+{
+    delta_copy_t *copy;
+    uint32_t used = 0;
+    uint32_t n;
+
+    while (stage_ctx.stage_state == SYNC_DONE) {
+        if (stage_ctx.delta_ctx.op == DELTA_OP_NONE) {
+            if (used == len) {
+                break;
+            }
+            used += delta_parse_op(&stage_ctx.delta_ctx, in + used, len - used);
+            if (stage_ctx.delta_ctx.error) {
+                printf("Error: malformed delta patch\n");
+                stage_ctx.stage_state = SYNC_FAILURE;
+            }
             continue;
         }
-        if (   ipc_sync_cmd.magic == MAGIC_TASK_STATE_CMD
-                && ipc_sync_cmd.state == SYNC_READY) {
-            printf("task %x has finished its init phase, acknowledge...\n", id);
+        if ((stage_ctx.delta_ctx.op == DELTA_OP_INSERT) && (used == len)) {
+            break;
+        }
+        if ((stage_ctx.delta_ctx.op == DELTA_OP_COPY) && (stage_ctx.delta_ncopies == DELTA_COPIES_MAX)) {
+            /* no room left to record the COPY: write what we have */
+            if (flash_fill_commit(true) == false) {
+                return false;
+            }
+            continue;
+        }
+        n = session->transfer_size - stage_ctx.flash_fill;
+        if (n > stage_ctx.delta_ctx.remaining) {
+            n = stage_ctx.delta_ctx.remaining;
+        }
+        if (stage_ctx.delta_ctx.op == DELTA_OP_INSERT) {
+            if (n > len - used) {
+                n = len - used;
+            }
+            memcpy(flash_buf + stage_ctx.flash_fill, in + used, n);
+            used += n;
+        } else {
+            copy = &stage_ctx.delta_copies[stage_ctx.delta_ncopies++];
+            copy->src = stage_ctx.delta_ctx.src;
+            copy->offset = stage_ctx.flash_fill;
+            copy->len = n;
+        }
+        stage_ctx.flash_fill += n;
+        delta_op_advance(&stage_ctx.delta_ctx, n);
+        if (flash_fill_commit(false) == false) {
+            return false;
         }
+    }
+    if ((len == 0) && (stage_ctx.stage_state == SYNC_DONE) &&
+        (delta_is_idle(&stage_ctx.delta_ctx) == false)) {
+        printf("Error: truncated delta patch\n");
+        stage_ctx.stage_state = SYNC_FAILURE;
+    }
+
+    return true;
+}
+#endif
 
-        ipc_sync_cmd.magic = MAGIC_TASK_STATE_RESP;
-        ipc_sync_cmd.state = SYNC_ACKNOWLEDGE;
+/*
+ * Transform the decrypted data of a write request into the flash buffer,
+ * depending on the image options. An empty input terminates the image and
+ * flushes the buffer. Returns false on system error: failures due to the
+ * image content or to dfuflash are reported in stage_ctx.stage_state.
+ */
+static bool stage_to_flash(const uint8_t *in, uint32_t len)
+{
+    bool ok = false;
 
-        size = sizeof(struct sync_command);
-        ret = sys_ipc(IPC_SEND_SYNC, id, size, (char*)&ipc_sync_cmd);
-        if (ret != SYS_E_DONE) {
-            printf("sys_ipc(IPC_SEND_SYNC, %d) failed! Exiting...\n", id);
-            goto err;
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+    if (session->header_flags & DFU_HEADER_FLAG_COMPRESSED) {
+        ok = decompress_to_flash(in, len);
+    }
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+    if (session->header_flags & DFU_HEADER_FLAG_DELTA) {
+        ok = delta_to_flash(in, len);
+    }
+#endif
+    if (ok && (len == 0) && (stage_ctx.stage_state == SYNC_DONE)) {
+        ok = flash_fill_commit(true);
+    }
+    return ok;
+}
+
+/* Reset the transformation stages at the beginning of a new image */
+static void stage_reset(void)
+{
+    stage_ctx.flash_fill = 0;
+    stage_ctx.stage_state = SYNC_DONE;
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+    decomp_init(&stage_ctx.decomp_ctx);
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+    delta_init(&stage_ctx.delta_ctx);
+    stage_ctx.delta_ncopies = 0;
+#endif
+}
+#endif
+
+/*
+ * Open a session for a new DFU header. The sessions waiting for their header
+ * validation or transferring data are abandoned, as dfuusb restarts with a
+ * new image. Sessions being flushed are kept until dfuflash is done.
+ * Returns false if no session is available.
+ */
+static bool session_open(void)
+{
+    dfu_session_t *next = NULL;
+
+    for (uint8_t i = 0; i < DFU_SESSIONS_MAX; ++i) {
+        if (sessions[i].state == DFU_SESSION_FLUSHING) {
+            continue;
         }
+        sessions[i].state = DFU_SESSION_FREE;
+        if (next == NULL) {
+            next = &sessions[i];
+        }
+    }
+    if (next == NULL) {
+        return false;
+    }
+    memset(next, 0, sizeof(dfu_session_t));
+    next->state = DFU_SESSION_HEADER_PENDING;
+    next->seq = ++session_seq;
+    session = next;
+#ifdef DFUCRYPTO_STAGING
+    stage_reset();
+#endif
 
-        if (id == id_smart) { smart_ready = true; }
-        if (id == id_usb)   { usb_ready = true; }
-        if (id == id_dfuflash)  { flash_ready = true; }
+    return true;
+}
 
-    } while (   (smart_ready == false)
-             || (usb_ready   == false)
-             || (flash_ready  == false));
-    printf("All tasks have finished their initialization, continuing...\n");
+/* Oldest session being flushed, the one dfuflash finishes first */
+static dfu_session_t *session_flushing(void)
+{
+    dfu_session_t *oldest = NULL;
 
-    /*******************************************
-     * End of full task end_of_init synchronization
-     *******************************************/
+    for (uint8_t i = 0; i < DFU_SESSIONS_MAX; ++i) {
+        if ((sessions[i].state == DFU_SESSION_FLUSHING) &&
+            ((oldest == NULL) || ((int32_t)(sessions[i].seq - oldest->seq) < 0))) {
+            oldest = &sessions[i];
+        }
+    }
+    return oldest;
+}
 
-    /*******************************************
-     * Ask smart for key injection and
-     * get back key hash
-     *******************************************/
+#ifdef CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED
+/*
+ * Compare the digests of the crypto chunks of [start, end[ given by
+ * dfusmart with the digests of the current content of their target flash
+ * area, computed by dfuflash. unchanged is true if all of them match.
+ */
+static bool skip_region_compare(uint32_t start, uint32_t end, bool *unchanged)
+{
+    struct sync_command_data expected;
+    struct sync_command_data installed;
+    uint32_t len;
+    bool valid;
+
+    *unchanged = false;
+    for (uint32_t offset = start; offset < end; offset += session->crypto_chunk_size) {
+        len = (end - offset < session->crypto_chunk_size) ? (end - offset) : session->crypto_chunk_size;
+        if (peer_request(id_smart, MAGIC_DFU_CHUNK_DIGEST, offset / session->crypto_chunk_size, 0,
+                         &expected, &valid) == false) {
+            return false;
+        }
+        if ((valid == false) || (expected.data_size < 32)) {
+            return true;
+        }
+        if (peer_request(id_dfuflash, MAGIC_DFU_FLASH_DIGEST, offset, len,
+                         &installed, &valid) == false) {
+            return false;
+        }
+        if ((valid == false) || (installed.data_size < 32) ||
+            (memcmp(expected.data.u8, installed.data.u8, 32) != 0)) {
+            return true;
+        }
+    }
+    *unchanged = true;
 
-    /* Then Syncrhonize with crypto */
-    size = sizeof(struct sync_command);
+    return true;
+}
 
-    printf("sending end_of_init synchronization to smart\n");
-    ipc_sync_cmd.magic = MAGIC_CRYPTO_INJECT_CMD;
-    ipc_sync_cmd.state = SYNC_READY;
+/*
+ * dfuflash erases a sector inline, when it is first written to: an unchanged
+ * area can only be skipped if none of its sectors is written. On the first
+ * request of a crypto chunk starting a flash sector, the skip region is
+ * extended to the smallest set of whole sectors ending on a crypto chunk
+ * boundary (or at the end of the image), and skipped if all its crypto
+ * chunks are unchanged. Chunks starting in the middle of a sector share it
+ * with a written chunk, and are written.
+ */
+static bool skip_region_update(void)
+{
+    struct sync_command_data skip_cmd = { 0 };
+    struct sync_command_data sector;
+    uint32_t start = session->total_bytes_read;
+    uint32_t end;
+    bool valid;
+    bool unchanged;
+
+    if (start < session->skip_region_end) {
+        return true;
+    }
+    session->skip_region = false;
+    if (!(session->header_flags & DFU_HEADER_FLAG_DIGESTS) || (start >= session->image_size) ||
+        (offset_in_chunk(start) != 0)) {
+        return true;
+    }
+    /* by default, the crypto chunk is written */
+    session->skip_region_end = start + session->crypto_chunk_size;
+    if (peer_request(id_dfuflash, MAGIC_DFU_FLASH_SECTOR, start, 0, &sector, &valid) == false) {
+        return false;
+    }
+    if ((valid == false) || (sector.data.u32[0] != start) || (sector.data.u32[1] == 0)) {
+        return true;
+    }
+    while (1) {
+        end = sector.data.u32[0] + sector.data.u32[1];
+        if (end % session->crypto_chunk_size != 0) {
+            end += session->crypto_chunk_size - (end % session->crypto_chunk_size);
+        }
+        if (end >= session->image_size) {
+            end = session->image_size;
+            break;
+        }
+        if (peer_request(id_dfuflash, MAGIC_DFU_FLASH_SECTOR, end, 0, &sector, &valid) == false) {
+            return false;
+        }
+        if ((valid == false) || (sector.data.u32[0] > end) ||
+            (sector.data.u32[1] <= end - sector.data.u32[0])) {
+            /* unknown layout: the default is kept */
+            return true;
+        }
+        if (sector.data.u32[0] == end) {
+            break;
+        }
+    }
+    session->skip_region_end = end;
+    if (skip_region_compare(start, end, &unchanged) == false) {
+        return false;
+    }
+    if (unchanged == false) {
+        return true;
+    }
 
-    ret = sys_ipc(IPC_SEND_SYNC, id_smart, size, (char*)&ipc_sync_cmd);
-    if (ret != SYS_E_DONE) {
-        printf("sys_ipc(IPC_SEND_SYNC, id_smart) failed! Exiting...\n");
-        goto err;
+    skip_cmd.magic = MAGIC_DFU_FLASH_SKIP;
+    skip_cmd.state = SYNC_WAIT;
+    skip_cmd.data_size = 2 * sizeof(uint32_t);
+    skip_cmd.data.u32[0] = start;
+    skip_cmd.data.u32[1] = end - start;
+    if (sys_ipc(IPC_SEND_SYNC, id_dfuflash, sizeof(struct sync_command_data), (const char*)&skip_cmd) != SYS_E_DONE) {
+        return false;
     }
+#if CRYPTO_DEBUG
+    printf("[write] sectors %x -> %x unchanged, skipped\n", start, end);
+#endif
+    session->skip_region = true;
 
-    id = id_smart;
-    size = sizeof(struct sync_command);
+    return true;
+}
+#endif
 
-    ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd_data);
-    if(ret != SYS_E_DONE){
-        goto err;
+/*
+ * Write automaton: decrypt the chunk received by dfuusb in its DMA SHM and
+ * hand it to dfuflash. The acknowledge to send back to dfuusb is returned in
+ * ack.
+ */
+static bool dataplane_write(const struct sync_command_data *req,
+                         struct sync_command_data *ack)
+{
+    const uint8_t *in = (const uint8_t *)shms_tab[ID_USB].address;
+    struct sync_command_data ipc_sync_cmd_data;
+    logsize_t size;
+    uint8_t id;
+    uint64_t stage_start;
+    e_syscall_ret ret;
+
+    if (session->state != DFU_SESSION_ACTIVE) {
+        printf("Error: write request out of an active DFU session\n");
+        return false;
+    }
+#ifdef DFUCRYPTO_STAGING
+    /* once the transformed image is broken, its requests are only failed */
+    if ((session->header_flags & DFU_HEADER_FLAGS_STAGED) && (stage_ctx.stage_state != SYNC_DONE)) {
+        *ack = *req;
+        ack->state = stage_ctx.stage_state;
+        return true;
+    }
+#endif
+
+    /* Ask dfusmart to reinject the key (only for AES) */
+    if (is_new_chunk()) {
+#if CRYPTO_DEBUG
+        printf("===> Asking for reinjection!\n");
+#endif
+        stage_start = perf_now();
+        /* When switching chunks, we have to inject the key again */
+        id = id_smart;
+        size = sizeof (struct sync_command);
+        ipc_sync_cmd_data.magic = MAGIC_CRYPTO_INJECT_CMD;
+        /* FIXME: this IPC should transmit the current chunk in order to generate its hash */
+
+        ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command), (char*)&ipc_sync_cmd_data);
+        if(ret != SYS_E_DONE){
+            return false;
+        }
+
+        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd_data);
+        if(ret != SYS_E_DONE){
+            return false;
+        }
+#if CRYPTO_DEBUG
+        printf("===> Key reinjection done!\n");
+#endif
+        perf_account(PERF_STAGE_KEY_INJECT, stage_start);
+    }
+
+    /********* FIRMWARE DECRYPTION LOGIC ************************************************************/
+    /* We have to split our encryption in multiple subencryptions to deal with key session modification
+     * on the crypto chunk size boundaries
+     */
+    uint32_t chunk_size = req->data.u16[0];
+    uint32_t chunk_size_aligned = chunk_size;
+    /* NOTE: the unerlying hardware does not support CTR mode on unaligned plaintexts:
+     * we have to align our size on the AES block size boundary
+     */
+    if(chunk_size_aligned % 16 != 0){
+        chunk_size_aligned += (16 - (chunk_size_aligned % 16));
+    }
+
+    if ((chunk_size_aligned > shms_tab[ID_USB].size) ||
+            (chunk_size_aligned > shms_tab[ID_FLASH].size))
+    {
+        printf("Error: chunk size overflows the max supported DMA SHR buffer size\n");
+        return false;
+    }
+    /* the key changes on crypto chunk boundaries */
+    if (offset_in_chunk(session->total_bytes_read) + chunk_size > session->crypto_chunk_size) {
+        printf("Error: chunk size %d crosses a crypto chunk boundary\n", chunk_size);
+        return false;
+    }
+#if CRYPTO_DEBUG
+    printf("Launching crypto DMA on chunk size %d (non aligned %d)\n", chunk_size_aligned, chunk_size);
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED
+    if (skip_region_update() == false) {
+        printf("Error ! unable to check the installed sectors digests!\n");
+        return false;
+    }
+    if (session->skip_region) {
+        /* no decryption nor flash write */
+        *ack = *req;
+        ack->state = SYNC_DONE;
+        session->total_bytes_read += chunk_size;
+        session->total_bytes_written += chunk_size;
+        return true;
+    }
+#endif
+    uint8_t *cryp_out = (uint8_t *)shms_tab[ID_FLASH].address;
+#ifdef DFUCRYPTO_STAGING
+    /* compressed and delta images are decrypted in the staging buffer,
+     * and then transformed into the flash SHM */
+    if (session->header_flags & DFU_HEADER_FLAGS_STAGED) {
+        if (chunk_size_aligned > sizeof(stage_buf)) {
+            printf("Error: chunk size overflows the staging buffer size\n");
+            return false;
+        }
+        cryp_out = stage_buf;
+    }
+#endif
+    /* The counter block is derived from the position of the request in the image,
+     * so that this transfer (and any retry of it) does not depend on the CRYP state
+     * left by the previous one. The CRYP DMA can't start in the middle of an AES block
+     */
+    if (offset_in_chunk(session->total_bytes_read) % 16 != 0) {
+        printf("Error: unaligned data offset %x in the image\n", session->total_bytes_read);
+        return false;
+    }
+    stage_start = perf_now();
+    if (cryp_dma_decrypt(in, cryp_out,
+                         chunk_size_aligned, offset_in_chunk(session->total_bytes_read)) == false) {
+        return false;
+    }
+    perf_account(PERF_STAGE_CRYP_DMA, stage_start);
+    /****************************************************************************************/
+
+#if CRYPTO_DEBUG
+    printf("[write] CRYP DMA has finished ! %d (non aligned %d)\n", chunk_size_aligned, chunk_size);
+#endif
+#ifdef DFUCRYPTO_STAGING
+    if (session->header_flags & DFU_HEADER_FLAGS_STAGED) {
+        if (stage_to_flash(stage_buf, chunk_size) == false) {
+            return false;
+        }
+        /* there may have been no flash write for this chunk: the
+         * acknowledge is built from the request, with the state of the
+         * flash writes and of the transformation */
+        *ack = *req;
+        ack->state = stage_ctx.stage_state;
+    } else
+#endif
+    if (flash_write(req, chunk_size, ack) == false) {
+        return false;
     }
 
-    if (   ipc_sync_cmd_data.magic == MAGIC_CRYPTO_INJECT_RESP
-        && ipc_sync_cmd_data.state == SYNC_DONE) {
-        printf("key injection done from smart. Hash received.\n");
+    session->total_bytes_read += chunk_size;
 
+    return true;
+}
+
+#ifdef CONFIG_APP_DFUCRYPTO_EARLY_DATA
+/*
+ * Write request received while the DFU header is being validated by
+ * dfusmart. The key of the first crypto chunk is only available once the
+ * header is valid: the request is left in the USB DMA SHM and its handling,
+ * hence its acknowledge, is deferred until the header validation. dfuusb
+ * sends at most one such request, and then waits for both its acknowledge
+ * and the header validation result.
+ */
+static struct sync_command_data early_deferred;
+static bool early_deferred_valid = false;
+
+static void early_data_reset(void)
+{
+    early_deferred_valid = false;
+}
+
+/*
+ * End of the DFU header validation, before its result is given to dfuusb:
+ * the deferred request, if any, is decrypted and written if the header is
+ * valid, and failed otherwise. Its acknowledge is then sent to dfuusb.
+ */
+static bool early_data_release(bool valid)
+{
+    struct sync_command_data ack;
+    e_syscall_ret ret;
+
+    if (early_deferred_valid == false) {
+        return true;
+    }
+    early_deferred_valid = false;
+    /* sent before the image geometry was known: the request is failed,
+     * without being consumed, if it does not fit */
+    if (valid && (early_deferred.data.u16[0] > session->transfer_size)) {
+        printf("Error: early chunk size %d overflows the transfer size\n", early_deferred.data.u16[0]);
+        valid = false;
+    }
+    if (valid) {
+        if (dataplane_write(&early_deferred, &ack) == false) {
+            return false;
+        }
+        perf_add_transfer(early_deferred.data.u16[0], false);
     } else {
-        goto err;
+        ack = early_deferred;
+        ack.state = SYNC_FAILURE;
+    }
+    ack.magic = MAGIC_DATA_WR_DMA_ACK;
+    ret = sys_ipc(IPC_SEND_SYNC, id_usb, sizeof(struct sync_command_data), (const char*)&ack);
+    if (ret != SYS_E_DONE) {
+        printf("Error ! unable to send back DMA_WR_ACK to usb!\n");
+        return false;
     }
-    cryp_init_dma(my_cryptin_handler, my_cryptout_handler, dma_in_desc, dma_out_desc);
 
+    return true;
+}
+#endif
 
-    /*******************************************
-     * Here, the key injection is done. This means that the authentication phase
-     * is terminated (this is required for the key injection to be complete).
-     * In order to ensure that dfusmart has not been corrupted and that the user
-     * has validated his passphrase, we ask pin to confirm this state.
-     *******************************************/
-    size = sizeof(struct sync_command);
-    ipc_sync_cmd_data.magic = MAGIC_AUTH_STATE_PASSED;
-    ipc_sync_cmd_data.state = SYNC_WAIT;
+/*
+ * Exchanges with dfusmart and dfuflash are synchronous both ways: a message
+ * is never sent to a peer which may itself be sending us an unsolicited one,
+ * otherwise both tasks block in their IPC_SEND_SYNC. Hence:
+ *   - while dfusmart validates a header, it is not sent anything else: the
+ *     WRITE_FINISHED of the previous image and a new header are held until
+ *     its verdict,
+ *   - while dfuflash flushes an image, it is not sent anything else: the
+ *     verdict of the next header, whose handling talks to dfuflash (early
+ *     data, erase-ahead...), is held until the WRITE_FINISHED of the image.
+ */
+static bool smart_busy = false;
+static struct sync_command_data held_header;
+static bool held_header_valid = false;
+static struct sync_command_data held_verdict;
+static bool held_verdict_valid = false;
+static struct sync_command_data held_write_finished;
+static bool held_write_finished_valid = false;
+
+/* Forward a DFU header to dfusmart for validation */
+static bool header_forward(const struct sync_command_data *header)
+{
+    e_syscall_ret ret;
 
-    if ((sys_ipc(IPC_SEND_SYNC, id_pin, size, (char*)&ipc_sync_cmd_data)) != SYS_E_DONE) {
-        printf("err: unable to request state confirmation from PIN\n");
-        goto err;
+#if CRYPTO_DEBUG
+    printf("[write] sending ipc to smart (%d)\n", id_smart);
+#endif
+    ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command_data), (const char*)header);
+    if (ret != SYS_E_DONE) {
+        printf("Error ! unable to send DFU_HEADER_SEND to smart!\n");
+        return false;
     }
+    smart_busy = true;
 
-    /* and wait for receiving... */
-    id = id_pin;
-    size = sizeof(struct sync_command);
-    if ((sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd_data)) != SYS_E_DONE) {
-        printf("err: unable to request state confirmation from PIN\n");
-        goto err;
+    return true;
+}
+
+/*
+ * dfuflash is done with the oldest flushed image: let dfusmart know and
+ * release its session.
+ */
+static bool flush_finished(const struct sync_command_data *finished)
+{
+    dfu_session_t *done;
+    e_syscall_ret ret;
+
+#if CRYPTO_DEBUG
+    printf("[write] sending ipc to smart (%d)\n", id_smart);
+#endif
+    ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command), (const char*)finished);
+    if (ret != SYS_E_DONE) {
+        printf("Error ! unable to send DFU_EOF to smart!\n");
+        return false;
+    }
+    done = session_flushing();
+    if (done != NULL) {
+        perf_report(done->transfer_size, done->transfer_size, done->crypto_chunk_size);
+        done->state = DFU_SESSION_FREE;
+    }
+
+    return true;
+}
+
+/*
+ * Header validation result of dfusmart for the current session. The image
+ * parameters are checked, then the verdict is given to dfuusb.
+ */
+static bool header_validated(struct sync_command_data *verdict)
+{
+    e_syscall_ret ret;
+
+    /* if header is valid, get back chunk size from smart */
+    if (verdict->magic == MAGIC_DFU_HEADER_VALID) {
+        session->crypto_chunk_size = verdict->data.u16[0];
+        /* the image size is optionally given in u32[1] */
+        if (verdict->data_size >= 2 * sizeof(uint32_t)) {
+            session->image_size = verdict->data.u32[1];
+        }
+        /* and the header options in u32[2] */
+        if (verdict->data_size >= 3 * sizeof(uint32_t)) {
+            session->header_flags = verdict->data.u32[2];
+        }
+        if ((session->header_flags & ~DFU_HEADER_FLAGS_SUPPORTED) ||
+            ((session->header_flags & DFU_HEADER_FLAGS_STAGED) == DFU_HEADER_FLAGS_STAGED) ||
+            ((session->header_flags & DFU_HEADER_FLAG_DIGESTS) &&
+             ((session->header_flags & DFU_HEADER_FLAGS_STAGED) || (session->image_size == 0)))) {
+            /* we can't process this image: let dfuusb know it is invalid */
+            printf("Error: unsupported DFU header options %x\n", session->header_flags);
+            verdict->magic = MAGIC_DFU_HEADER_INVALID;
+        }
+#if CRYPTO_DEBUG
+        printf("chunk size received: %x\n", session->crypto_chunk_size);
+#endif
+        /* Check the transfer size against the image geometry */
+        if (verdict->magic == MAGIC_DFU_HEADER_VALID) {
+            session->transfer_size = chunk_geometry_check();
+            if (session->transfer_size == 0) {
+                verdict->magic = MAGIC_DFU_HEADER_INVALID;
+            }
+        }
+    }
+    session->state = (verdict->magic == MAGIC_DFU_HEADER_VALID) ?
+                     DFU_SESSION_ACTIVE : DFU_SESSION_FREE;
+#ifdef CONFIG_APP_DFUCRYPTO_EARLY_DATA
+    /* the request received during the validation is handled and
+     * acknowledged first, as dfuusb waits for its acknowledge */
+    if (early_data_release(verdict->magic == MAGIC_DFU_HEADER_VALID) == false) {
+        return false;
+    }
+#endif
+    /* in case of invalid header, the invalid information state is sent back
+     * to dfuusb */
+#if CRYPTO_DEBUG
+    printf("[write] sending ipc to dfuusb (%d)\n", id_usb);
+#endif
+    ret = sys_ipc(IPC_SEND_SYNC, id_usb, sizeof(struct sync_command_data), (const char*)verdict);
+    if (ret != SYS_E_DONE) {
+        printf("Error ! unable to send DFU_HEADER_VALID to dfuusb!\n");
+        return false;
     }
-    if (   ipc_sync_cmd_data.magic != MAGIC_AUTH_STATE_PASSED
-        || ipc_sync_cmd_data.state != SYNC_ACKNOWLEDGE) {
-        printf("Pin didn't acknowledge that we are in post authentication phase!\n");
-        goto err;
+#ifdef CONFIG_APP_DFUCRYPTO_ERASE_AHEAD
+    /* the first sectors are erased while the first transfer is received */
+    if ((verdict->magic == MAGIC_DFU_HEADER_VALID) && (erase_ahead() == false)) {
+        return false;
     }
+#endif
 
-    printf("PIN has confirmed that we are in post-authentication phase. Continuing...\n");
+    return true;
+}
 
-    /*******************************************
-     * cryptography initialization done.
-     * Let start 2nd pase (Flash/Crypto/USB-DFU runtime)
-     *******************************************/
+/*
+ * Startup handshake. CRYPTO is a central node: each peer goes through its
+ * own sequence of steps, and the messages are accepted from any peer, in any
+ * order. The only cross-peer dependencies are the ones the security of the
+ * DFU relies on:
+ *   - pin is asked to confirm the post-authentication state once dfusmart
+ *     has injected the key,
+ *   - dfuusb and dfuflash are released (end_of_cryp) once pin has confirmed
+ *     this state.
+ * This way, the key injection (and the user authentication behind it) runs
+ * while dfuusb and dfuflash are still initializing, and their end_of_cryp
+ * responses and DMA SHM info are collected as they come.
+ */
+enum startup_step {
+    STARTUP_WAIT_READY = 0,     /* waiting for MAGIC_TASK_STATE_CMD */
+    STARTUP_WAIT_INJECT,        /* dfusmart: waiting for the key injection */
+    STARTUP_WAIT_AUTH,          /* pin: waiting for the authentication state */
+    STARTUP_WAIT_RELEASE,       /* dfuusb/dfuflash: waiting for the authentication */
+    STARTUP_WAIT_CRYP_RESP,     /* dfuusb/dfuflash: waiting for end_of_cryp response */
+    STARTUP_WAIT_SHM,           /* dfuusb/dfuflash: waiting for the DMA SHM info */
+    STARTUP_DONE
+};
 
-    size = sizeof(struct sync_command);
+struct dmashm_info {
+    uint32_t addr;
+    uint16_t size;
+};
 
-    printf("sending end_of_cryp synchronization to dfuflash\n");
-    ipc_sync_cmd.magic = MAGIC_TASK_STATE_CMD;
-    ipc_sync_cmd.state = SYNC_READY;
+static bool startup_send(uint8_t dest, uint8_t magic, uint8_t state)
+{
+    struct sync_command sync_cmd;
 
-    /* First inform SDIO block that everything is ready... */
-    ret = sys_ipc(IPC_SEND_SYNC, id_dfuflash, size, (char*)&ipc_sync_cmd);
-    if (ret != SYS_E_DONE) {
-        printf("sys_ipc(IPC_SEND_SYNC, id_sdio) failed! Exiting...\n");
-        goto err;
+    sync_cmd.magic = magic;
+    sync_cmd.state = state;
+    if (sys_ipc(IPC_SEND_SYNC, dest, sizeof(struct sync_command), (char*)&sync_cmd) != SYS_E_DONE) {
+        printf("sys_ipc(IPC_SEND_SYNC, %d) failed! Exiting...\n", dest);
+        return false;
     }
-    printf("sending end_of_cryp to dfuflash done.\n");
-
-
-    printf("sending end_of_cryp synchronization to usb-dfu\n");
-    ipc_sync_cmd.magic = MAGIC_TASK_STATE_CMD;
-    ipc_sync_cmd.state = SYNC_READY;
+    return true;
+}
 
-    /* First inform SDIO block that everything is ready... */
-    ret = sys_ipc(IPC_SEND_SYNC, id_usb, size, (char*)&ipc_sync_cmd);
-    if (ret != SYS_E_DONE) {
-        printf("sys_ipc(IPC_SEND_SYNC, id_sdio) failed! Exiting...\n");
-        goto err;
+/* send end_of_cryp to dfuusb or dfuflash, once both ready and authenticated */
+static bool startup_release(uint8_t dest, enum startup_step *step, enum startup_step pin_step)
+{
+    if ((*step != STARTUP_WAIT_RELEASE) || (pin_step != STARTUP_DONE)) {
+        return true;
+    }
+    printf("sending end_of_cryp synchronization to %x\n", dest);
+    if (startup_send(dest, MAGIC_TASK_STATE_CMD, SYNC_READY) == false) {
+        return false;
     }
-    printf("sending end_of_cryp to usb-dfu done.\n");
+    *step = STARTUP_WAIT_CRYP_RESP;
+    return true;
+}
 
+static bool startup_handshake(void)
+{
+    enum startup_step smart_step = STARTUP_WAIT_READY;
+    enum startup_step usb_step = STARTUP_WAIT_READY;
+    enum startup_step flash_step = STARTUP_WAIT_READY;
+    enum startup_step pin_step = STARTUP_WAIT_READY;
+    enum startup_step *step;
+    union {
+        struct sync_command      cmd;
+        struct sync_command_data cmd_data;
+        struct dmashm_info       shm_info;
+    } msg;
+    logsize_t size;
+    uint8_t id;
+    enum shms shm_id;
 
-    printf("waiting for end_of_cryp response from USB-DFU & FLASH\n");
-    for (uint8_t i = 0; i < 2; ++i) {
+    while ((usb_step != STARTUP_DONE) || (flash_step != STARTUP_DONE)) {
         id = ANY_APP;
-        size = sizeof(struct sync_command);
-
-        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd);
-        if (ret == SYS_E_DONE) {
-            if (id == id_usb) {
-                if (ipc_sync_cmd.magic == MAGIC_TASK_STATE_RESP
-                        && ipc_sync_cmd.state == SYNC_READY) {
-                    printf("USB-DFU module is ready\n");
-                }
-            } else if (id == id_dfuflash) {
-                if (ipc_sync_cmd.magic == MAGIC_TASK_STATE_RESP
-                        && ipc_sync_cmd.state == SYNC_READY) {
-                    printf("FLASH module is ready\n");
-                }
-            } else {
-                    printf("received msg from id %d ??\n", id);
-            }
+        size = sizeof(msg);
+        if (sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&msg) != SYS_E_DONE) {
+            /* defensive programing, should not append as there is no
+             * asynchronous IPC in this task */
+            continue;
         }
-        else{
-            goto err;
+
+        if (id == id_smart) {
+            step = &smart_step;
+        } else if (id == id_usb) {
+            step = &usb_step;
+        } else if (id == id_dfuflash) {
+            step = &flash_step;
+        } else if (id == id_pin) {
+            step = &pin_step;
+        } else {
+            printf("received msg from id %d ??\n", id);
+            continue;
         }
-    }
 
+        /* pin may signal the end of its init at any time, even after it has
+         * confirmed the authentication state: it is only acknowledged, the
+         * confirmation request does not depend on it */
+        if (   (id == id_pin)
+            && (msg.cmd.magic == MAGIC_TASK_STATE_CMD)
+            && (msg.cmd.state == SYNC_READY)) {
+            printf("task %x has finished its init phase, acknowledge...\n", id);
+            if (startup_send(id, MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE) == false) {
+                return false;
+            }
+            continue;
+        }
 
-    /*******************************************
-     * Syncrhonizing DMA SHM buffer address with USB and SDIO, through IPC
-     ******************************************/
-    struct dmashm_info {
-        uint32_t addr;
-        uint16_t size;
-    };
+        switch (*step) {
+            case STARTUP_WAIT_READY:
+                if (   msg.cmd.magic != MAGIC_TASK_STATE_CMD
+                    || msg.cmd.state != SYNC_READY) {
+                    printf("unexpected msg from id %d during init\n", id);
+                    continue;
+                }
+                printf("task %x has finished its init phase, acknowledge...\n", id);
+                if (startup_send(id, MAGIC_TASK_STATE_RESP, SYNC_ACKNOWLEDGE) == false) {
+                    return false;
+                }
+                if (id == id_smart) {
+                    /* Ask smart for key injection and get back key hash */
+                    printf("sending end_of_init synchronization to smart\n");
+                    if (startup_send(id_smart, MAGIC_CRYPTO_INJECT_CMD, SYNC_READY) == false) {
+                        return false;
+                    }
+                    smart_step = STARTUP_WAIT_INJECT;
+                } else {
+                    *step = STARTUP_WAIT_RELEASE;
+                    if (startup_release(id, step, pin_step) == false) {
+                        return false;
+                    }
+                }
+                break;
+
+            case STARTUP_WAIT_INJECT:
+                if (   msg.cmd_data.magic != MAGIC_CRYPTO_INJECT_RESP
+                    || msg.cmd_data.state != SYNC_DONE) {
+                    printf("key injection failed!\n");
+                    return false;
+                }
+                printf("key injection done from smart. Hash received.\n");
+                cryp_init_dma(my_cryptin_handler, my_cryptout_handler, dma_in_desc, dma_out_desc);
+                smart_step = STARTUP_DONE;
+                /*
+                 * Here, the key injection is done. This means that the authentication phase
+                 * is terminated (this is required for the key injection to be complete).
+                 * In order to ensure that dfusmart has not been corrupted and that the user
+                 * has validated his passphrase, we ask pin to confirm this state.
+                 */
+                if (startup_send(id_pin, MAGIC_AUTH_STATE_PASSED, SYNC_WAIT) == false) {
+                    printf("err: unable to request state confirmation from PIN\n");
+                    return false;
+                }
+                pin_step = STARTUP_WAIT_AUTH;
+                break;
 
-    struct dmashm_info shm_info;
+            case STARTUP_WAIT_AUTH:
+                if (   msg.cmd.magic != MAGIC_AUTH_STATE_PASSED
+                    || msg.cmd.state != SYNC_ACKNOWLEDGE) {
+                    printf("Pin didn't acknowledge that we are in post authentication phase!\n");
+                    return false;
+                }
+                printf("PIN has confirmed that we are in post-authentication phase. Continuing...\n");
+                pin_step = STARTUP_DONE;
+                /* cryptography initialization done: release the peers already waiting */
+                if (   (startup_release(id_dfuflash, &flash_step, pin_step) == false)
+                    || (startup_release(id_usb, &usb_step, pin_step) == false)) {
+                    return false;
+                }
+                break;
 
-    // 2 receptions are waited: one from usb, one from sdio, in whatever order
-    for (uint8_t i = 0; i < 2; ++i) {
-        id = ANY_APP;
-        size = sizeof(struct dmashm_info);
-
-        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&shm_info);
-        if (ret == SYS_E_DONE) {
-            if (id == id_usb) {
-                    shms_tab[ID_USB].address = shm_info.addr;
-                    shms_tab[ID_USB].size = shm_info.size;
-		    usb_chunk_size = shms_tab[ID_USB].size;
-                    printf("received DMA SHM info from USB: @: %x, size: %d\n",
-                            shms_tab[ID_USB].address, shms_tab[ID_USB].size);
-            } else if (id == id_dfuflash) {
-                    shms_tab[ID_FLASH].address = shm_info.addr;
-                    shms_tab[ID_FLASH].size = shm_info.size;
-		    flash_chunk_size = shms_tab[ID_FLASH].size;
-                    printf("received DMA SHM info from SDIO: @: %x, size: %d\n",
-                            shms_tab[ID_FLASH].address, shms_tab[ID_FLASH].size);
-            } else {
-                    printf("received msg from id %d ??\n", id);
-            }
-        }
-        else{
-           goto err;
+            case STARTUP_WAIT_CRYP_RESP:
+                if (   msg.cmd.magic != MAGIC_TASK_STATE_RESP
+                    || msg.cmd.state != SYNC_READY) {
+                    printf("%s didn't acknowledge end_of_cryp!\n", (id == id_usb) ? "USB-DFU" : "FLASH");
+                    return false;
+                }
+                printf("%s module is ready\n", (id == id_usb) ? "USB-DFU" : "FLASH");
+                *step = STARTUP_WAIT_SHM;
+                break;
+
+            case STARTUP_WAIT_SHM:
+                /* Syncrhonizing DMA SHM buffer address with USB and FLASH */
+                shm_id = (id == id_usb) ? ID_USB : ID_FLASH;
+                shms_tab[shm_id].address = msg.shm_info.addr;
+                shms_tab[shm_id].size = msg.shm_info.size;
+                printf("received DMA SHM info from %s: @: %x, size: %d\n",
+                        (shm_id == ID_USB) ? "USB" : "FLASH",
+                        shms_tab[shm_id].address, shms_tab[shm_id].size);
+                *step = STARTUP_DONE;
+                break;
+
+            default:
+                printf("unexpected msg from id %d during init\n", id);
+                break;
         }
     }
 
+    return true;
+}
+
+/*
+ * Data plane: dispatch of the DFU requests from the peers, until an error
+ * requires a reboot.
+ */
+static void dataplane_loop(void)
+{
+    e_syscall_ret ret;
+
     /*******************************************
      * Now crypto will wait for IPC orders from USB
      * (read or write access request) and transmit it
@@ -474,11 +1407,16 @@ int _main(uint32_t task_id)
     struct sync_command_data dataplane_command_rw = { 0 };
     struct sync_command_data dataplane_command_ack = { 0 };
     uint8_t sinker = 0;
+    uint64_t usb_wait_start;
+    uint64_t stage_start;
 
     while (1) {
         /* requests can come from USB, SDIO, or SMART */
         sinker = ANY_APP;
         ipcsize = sizeof(ipc_mainloop_cmd);
+        /* the time until the next write request is spent waiting for dfuusb,
+         * whatever the peer handled in the previous iteration */
+        usb_wait_start = perf_now();
         // wait for read or write request from USB
 
         ret = sys_ipc(IPC_RECV_SYNC, &sinker, &ipcsize, (char*)&ipc_mainloop_cmd);
@@ -550,128 +1488,33 @@ int _main(uint32_t task_id)
                         goto err;
                     }
 
-                    dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
-                    struct sync_command_data flash_dataplane_command_rw = dataplane_command_rw;
-
-                    /* Ask dfusmart to reinject the key (only for AES) */
-                    if (is_new_chunk()) {
-#if CRYPTO_DEBUG
-                        printf("===> Asking for reinjection!\n");
-#endif
-                        /* When switching chunks, we have to inject the key again */
-                        id = id_smart;
-                        size = sizeof (struct sync_command);
-                        ipc_sync_cmd_data.magic = MAGIC_CRYPTO_INJECT_CMD;
-                        /* FIXME: this IPC should transmit the current chunk in order to generate its hash */
-
-                        ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command), (char*)&ipc_sync_cmd_data);
-                        if(ret != SYS_E_DONE){
-                            goto err;
-                        }
-
-                        ret = sys_ipc(IPC_RECV_SYNC, &id, &size, (char*)&ipc_sync_cmd_data);
-                        if(ret != SYS_E_DONE){
-                            goto err;
-                        }
-#if CRYPTO_DEBUG
-                        printf("===> Key reinjection done!\n");
-#endif
-                    }
-                    if(is_new_chunk() || is_initial_chunk()){
-                        /* Set the initial IV to zero and configure the algorithm in the CRYP */
-                        uint8_t null_iv[16] = { 0 };
-                        cryp_init_user(KEY_128, null_iv, 16, AES_CTR, DECRYPT);
-                    }
+                    perf_account(PERF_STAGE_USB_WAIT, usb_wait_start);
 
-                    /********* FIRMWARE DECRYPTION LOGIC ************************************************************/
-                    /* We have to split our encryption in multiple subencryptions to deal with key session modification
-                     * on the crypto chunk size boundaries
-                     */
+                    dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
                     uint32_t chunk_size = dataplane_command_rw.data.u16[0];
-                    uint32_t chunk_size_aligned = chunk_size;
-                    /* NOTE: the unerlying hardware does not support CTR mode on unaligned plaintexts:
-                     * we have to align our size on the AES block size boundary
-                     */
-                    if(chunk_size_aligned % 16 != 0){
-                        chunk_size_aligned += (16 - (chunk_size_aligned % 16));
-                    }
-
-                    if ((chunk_size_aligned > shms_tab[ID_USB].size) ||
-                            (chunk_size_aligned > shms_tab[ID_USB].size))
-                    {
-                        printf("Error: chunk size overflows the max supported DMA SHR buffer size\n");
-                        goto err;
-                    }
-#if CRYPTO_DEBUG
-                    printf("Launching crypto DMA on chunk size %d (non aligned %d)\n", chunk_size_aligned, chunk_size);
-#endif
-                    /* Save the current IV so that CTR is not broken when we perform DMA again in case of error */
-                    uint8_t curr_iv[16] = { 0 };
-                    /* Get current IV value */
-                    cryp_get_iv(curr_iv, 16);
-                    bool dma_error = false;
-DMA_XFR_AGAIN:
-                    if(dma_error == true){
-                        /* Set the IV to current value in case of DMA error to avoid desynchronisation */
-                        cryp_init_user(KEY_128, curr_iv, 16, AES_CTR, DECRYPT);
-                    }
-                    status_reg.dmain_fifo_err = status_reg.dmain_dm_err = status_reg.dmain_tr_err = false;
-                    status_reg.dmaout_fifo_err = status_reg.dmaout_dm_err = status_reg.dmaout_tr_err = false;
-                    status_reg.dmaout_done = status_reg.dmain_done = false;
-                    cryp_do_dma((const uint8_t *)shms_tab[ID_USB].address, (const uint8_t *)shms_tab[ID_FLASH].address, chunk_size_aligned, dma_in_desc, dma_out_desc);
-                    uint64_t dma_start_time, dma_curr_time;
-                    ret = sys_get_systick(&dma_start_time, PREC_MILLI);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error: unable to get systick value !\n");
-                        goto err;
-                    }
-                    while (status_reg.dmaout_done == false) {
-                        ret = sys_get_systick(&dma_curr_time, PREC_MILLI);
-                        if (ret != SYS_E_DONE) {
-                            printf("Error: unable to get systick value !\n");
+
+#ifdef CONFIG_APP_DFUCRYPTO_EARLY_DATA
+                    if (session->state == DFU_SESSION_HEADER_PENDING) {
+                        if (early_deferred_valid) {
+                            printf("Error: more than one write request during the header validation\n");
                             goto err;
                         }
-                        /* Do we have an error or a timeout? If yes, try again the DMA transfer, if no continue to wait */
-                        dma_error = status_reg.dmaout_fifo_err || status_reg.dmaout_dm_err || status_reg.dmaout_tr_err;
-                        if((dma_error == true) || ((dma_curr_time - dma_start_time) > 500)){
-#if CRYPTO_DEBUG
-                            printf("CRYP DMA out error ... Trying again\n");
-#endif
-                            cryp_flush_fifos();
-                            goto DMA_XFR_AGAIN;
-                        }
-                        continue;
+                        /* dfuusb waits for this acknowledge until the header validation */
+                        early_deferred = dataplane_command_rw;
+                        early_deferred_valid = true;
+                        break;
                     }
-                    cryp_wait_for_emtpy_fifos();
-                    /****************************************************************************************/
-
-#if CRYPTO_DEBUG
-                    printf("[write] CRYP DMA has finished ! %d (non aligned %d)\n", chunk_size_aligned, chunk_size);
 #endif
-#if CRYPTO_DEBUG
-                    printf("[write] sending ipc to flash (%d)\n", id_dfuflash);
-#endif
-
-                    ret = sys_ipc(IPC_SEND_SYNC, id_dfuflash, sizeof(struct sync_command_data), (const char*)&flash_dataplane_command_rw);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error ! unable to send DMA_WR_REQ to flash!\n");
-                    }
-
-                    // wait for flash task acknowledge (IPC)
-                    sinker = id_dfuflash;
-                    ipcsize = sizeof(struct sync_command_data);
-
-                    ret = sys_ipc(IPC_RECV_SYNC, &sinker, &ipcsize, (char*)&dataplane_command_ack);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error ! unable to receive back DMA_WR_ACK from flash!\n");
+                    if (dataplane_write(&dataplane_command_rw, &dataplane_command_ack) == false) {
                         goto err;
                     }
 
 #if CRYPTO_DEBUG
-                    printf("[write] received ipc from flash (%d), sending back to usb (%d)\n", sinker, id_usb);
+                    printf("[write] received ipc from flash (%d), sending back to usb (%d)\n", id_dfuflash, id_usb);
 #endif
                     // set ack magic for write ack
                     dataplane_command_ack.magic = MAGIC_DATA_WR_DMA_ACK;
+                    stage_start = perf_now();
                     // acknowledge to USB: data has been written to disk (IPC)
                     ret = sys_ipc(IPC_SEND_SYNC, id_usb, sizeof(struct sync_command_data), (const char*)&dataplane_command_ack);
                     if (ret != SYS_E_DONE) {
@@ -679,7 +1522,17 @@ DMA_XFR_AGAIN:
                         goto err;
                     }
 
-                    total_bytes_read += chunk_size;
+                    perf_account(PERF_STAGE_USB_ACK, stage_start);
+                    perf_add_transfer(chunk_size, false);
+#ifdef CONFIG_APP_DFUCRYPTO_ERASE_AHEAD
+                    /* dfuflash is idle until the next request of dfuusb */
+                    stage_start = perf_now();
+                    if (erase_ahead() == false) {
+                        goto err;
+                    }
+                    perf_account(PERF_STAGE_FLASH_WRITE, stage_start);
+#endif
+
                     break;
 
                 }
@@ -687,9 +1540,6 @@ DMA_XFR_AGAIN:
 
             case MAGIC_DFU_HEADER_SEND:
                 {
-		    /* Reset our global vairables */
-		    crypto_chunk_size = 0;
-		    total_bytes_read = 0;
                     /***************************************************
                      * DFUUSB request for smart
                      **************************************************/
@@ -700,13 +1550,31 @@ DMA_XFR_AGAIN:
 
                     dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
 
-#if CRYPTO_DEBUG
-                    printf("[write] sending ipc to smart (%d)\n", id_smart);
+                    /* Open a new session, the previous image may still be flushed */
+                    if (session_open() == false) {
+                        printf("Error: no DFU session available\n");
+                        dataplane_command_rw.magic = MAGIC_DFU_HEADER_INVALID;
+                        ret = sys_ipc(IPC_SEND_SYNC, id_usb, sizeof(struct sync_command_data), (const char*)&dataplane_command_rw);
+                        if (ret != SYS_E_DONE) {
+                            printf("Error ! unable to send DFU_HEADER_INVALID to dfuusb!\n");
+                            goto err;
+                        }
+                        break;
+                    }
+#ifdef CONFIG_APP_DFUCRYPTO_EARLY_DATA
+                    early_data_reset();
 #endif
-
-                    ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command_data), (const char*)&dataplane_command_rw);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error ! unable to send DFU_HEADER_SEND to smart!\n");
+                    perf_reset();
+                    /* a verdict held for the abandoned session is stale */
+                    held_verdict_valid = false;
+
+                    if (smart_busy) {
+                        /* the verdict of the abandoned header is still to come */
+                        held_header = dataplane_command_rw;
+                        held_header_valid = true;
+                        break;
+                    }
+                    if (header_forward(&dataplane_command_rw) == false) {
                         goto err;
                     }
 
@@ -723,6 +1591,15 @@ DMA_XFR_AGAIN:
 
                     dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
 
+#ifdef DFUCRYPTO_STAGING
+                    /* flush the end of the transformed stream before the EOF */
+                    if (session->header_flags & DFU_HEADER_FLAGS_STAGED) {
+                        if ((stage_to_flash(NULL, 0) == false) || (stage_ctx.stage_state != SYNC_DONE)) {
+                            printf("Error: transformed image failed, not terminated\n");
+                            goto err;
+                        }
+                    }
+#endif
 #if CRYPTO_DEBUG
                     printf("[write] sending ipc to flash (%d)\n", id_dfuflash);
 #endif
@@ -732,6 +1609,11 @@ DMA_XFR_AGAIN:
                         printf("Error ! unable to send DFU_EOF to flash!\n");
                         goto err;
                     }
+                    /* the next header can now be handled while dfuflash finishes */
+                    if (session->state == DFU_SESSION_ACTIVE) {
+                        session->state = DFU_SESSION_FLUSHING;
+                        perf_freeze();
+                    }
 
                     break;
 
@@ -746,15 +1628,22 @@ DMA_XFR_AGAIN:
 
                     dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
 
-#if CRYPTO_DEBUG
-                    printf("[write] sending ipc to smart (%d)\n", id_smart);
-#endif
-
-                    ret = sys_ipc(IPC_SEND_SYNC, id_smart, sizeof(struct sync_command), (const char*)&dataplane_command_rw);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error ! unable to send DFU_EOF to smart!\n");
+                    if (smart_busy) {
+                        /* dfusmart may be sending us its header verdict */
+                        held_write_finished = dataplane_command_rw;
+                        held_write_finished_valid = true;
+                        break;
+                    }
+                    if (flush_finished(&dataplane_command_rw) == false) {
                         goto err;
                     }
+                    /* dfuflash is idle: the held header verdict can be handled */
+                    if (held_verdict_valid) {
+                        held_verdict_valid = false;
+                        if (header_validated(&held_verdict) == false) {
+                            goto err;
+                        }
+                    }
 
                     break;
                 }
@@ -772,29 +1661,40 @@ DMA_XFR_AGAIN:
                         goto err;
                     }
 
+                    if (smart_busy == false) {
+                        printf("Error: unexpected DFU header validation\n");
+                        goto err;
+                    }
+                    smart_busy = false;
+
                     dataplane_command_rw = ipc_mainloop_cmd.sync_cmd_data;
 
-                    /* if header is valid, get back chunk size from smart */
-                    if (ipc_mainloop_cmd.magic == MAGIC_DFU_HEADER_VALID) {
-                        crypto_chunk_size = dataplane_command_rw.data.u16[0];
-#if CRYPTO_DEBUG
-                        printf("chunk size received: %x\n", crypto_chunk_size);
-#endif
-                        /* Perform sanity checks on the received chunk sizes */
-                        if(chunk_sizes_sanity_check() == false) {
-                            /* If there is an issue here, we go to error! */
+                    /* dfusmart is idle: forward what was held for it */
+                    if (held_write_finished_valid) {
+                        held_write_finished_valid = false;
+                        if (flush_finished(&held_write_finished) == false) {
                             goto err;
                         }
                     }
-                    /* in case of invalid header, the invalid information state is sent back
-                     * to dfuusb */
-#if CRYPTO_DEBUG
-                    printf("[write] sending ipc to dfuusb (%d)\n", id_usb);
-#endif
-
-                    ret = sys_ipc(IPC_SEND_SYNC, id_usb, sizeof(struct sync_command_data), (const char*)&dataplane_command_rw);
-                    if (ret != SYS_E_DONE) {
-                        printf("Error ! unable to send DFU_HEADER_VALID to dfuusb!\n");
+                    if (held_header_valid) {
+                        /* verdict of an abandoned header: validate the new one */
+                        held_header_valid = false;
+                        if (header_forward(&held_header) == false) {
+                            goto err;
+                        }
+                        break;
+                    }
+                    if (session->state != DFU_SESSION_HEADER_PENDING) {
+                        printf("Error: DFU header validation without session\n");
+                        goto err;
+                    }
+                    if (session_flushing() != NULL) {
+                        /* dfuflash may be sending us its WRITE_FINISHED */
+                        held_verdict = dataplane_command_rw;
+                        held_verdict_valid = true;
+                        break;
+                    }
+                    if (header_validated(&dataplane_command_rw) == false) {
                         goto err;
                     }
 
@@ -834,6 +1734,130 @@ DMA_XFR_AGAIN:
 
     }
 
+err:
+    ask_reboot();
+    while (1) {
+     	sys_yield();
+    }
+}
+
+/*
+ * We use the local -fno-stack-protector flag for main because
+ * the stack protection has not been initialized yet.
+ *
+ * We use _main and not main to permit the usage of exactly *one* arg
+ * without compiler complain. argc/argv is not a goot idea in term
+ * of size and calculation in a microcontroler
+ */
+int _main(uint32_t task_id)
+{
+    char *wellcome_msg = "hello, I'm crypto";
+//    char buffer_in[128];
+    char ipc_buf[32] = {0};
+    const char * inject_order = "INJECT";
+
+    strncpy(ipc_buf, inject_order, 6);
+#ifdef CONFIG_APP_CRYPTO_USE_GETCYCLES
+    device_t dev2;
+    memset(&dev2, 0, sizeof(device_t));
+    int      dev_descriptor = 0;
+#endif
+    e_syscall_ret ret = 0;
+
+    /**
+     * Initialization sequence
+     */
+    printf("%s, my id is %x\n", wellcome_msg, task_id);
+
+#ifdef CONFIG_APP_CRYPTO_USE_GETCYCLES
+    strncpy(dev.name, tim, 3);
+    dev2.address = 0x40000020;
+    dev2.size = 0x20;
+    dev2.isr_ctx_only = false;
+    dev2.irq_num = 0;
+    dev2.gpio_num = 0;
+
+    printf("registering %s driver\n", dev2.name);
+    if ((ret = sys_init(INIT_DEVACCESS, &dev2, &dev_descriptor)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+#endif
+
+    if ((ret = sys_init(INIT_GETTASKID, "dfusmart", &id_smart)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+    printf("smart is task %x !\n", id_smart);
+
+    if ((ret = sys_init(INIT_GETTASKID, "pin", &id_pin)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+    printf("pin is task %x !\n", id_pin);
+
+    if ((ret = sys_init(INIT_GETTASKID, "dfuflash", &id_dfuflash)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+    printf("sdio is task %x !\n", id_dfuflash);
+
+    if ((ret = sys_init(INIT_GETTASKID, "dfuusb", &id_usb)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+    printf("usb is task %x !\n", id_usb);
+
+    cryp_early_init(true, CRYP_MAP_AUTO, CRYP_USER, (int*) &dma_in_desc, (int*) &dma_out_desc);
+
+    printf("set init as done\n");
+    if ((ret = sys_init(INIT_DONE)) != SYS_E_DONE) {
+        printf("sys_init returns %s !\n", strerror(ret));
+        goto err_init;
+    }
+    printf("sys_init returns %s !\n", strerror(ret));
+
+    /*******************************************
+     * let's synchronize with other tasks, inject the key,
+     * confirm the authentication state and get back the DMA SHMs
+     *******************************************/
+    uint64_t startup_start = perf_now();
+
+    if (startup_handshake() == false) {
+        goto err;
+    }
+    perf_report_startup(startup_start);
+
+    /*******************************************
+     * dfuusb and dfuflash may share a single DMA SHM, in which case the
+     * CRYP decrypts in place. The buffer is owned by dfuusb until it sends a
+     * write request, then by the CRYP, and then by dfuflash until it
+     * acknowledges the write: dfuusb only gets it back with our write
+     * acknowledge, as the write automaton is fully serialized.
+     ******************************************/
+    if (shms_tab[ID_USB].address == shms_tab[ID_FLASH].address) {
+#ifdef CONFIG_APP_DFUCRYPTO_SHARED_SHM
+        if (shms_tab[ID_USB].size != shms_tab[ID_FLASH].size) {
+            printf("Error: shared DMA SHM declared with different sizes\n");
+            goto err;
+        }
+        printf("dfuusb and dfuflash share their DMA SHM, decrypting in place\n");
+#else
+        printf("Error: dfuusb and dfuflash share their DMA SHM, unsupported\n");
+        goto err;
+#endif
+    }
+
+#ifdef CONFIG_APP_DFUCRYPTO_DMA_BENCH
+    /* the key is injected: measure the CRYP DMA before the first image */
+    if (cryp_dma_bench() == false) {
+        goto err;
+    }
+#endif
+
+    /* never returns */
+    dataplane_loop();
+
 err_init:
     while (1) {
      	sys_yield();
@@ -26,6 +26,7 @@
 #define MAIN_H_
 
 #include "libc/types.h"
+#include "autoconf.h"
 
 typedef struct {
     bool dmain_done;
@@ -44,4 +45,72 @@ uint32_t get_cycles(void);
 
 #define PROD_CRYPTO_HARD 1
 
+/*
+ * MAGIC_DFU_HEADER_VALID payload, sent by dfusmart: u16[0] holds the crypto
+ * chunk size, u32[1] the image size and u32[2] the header options, when
+ * data_size covers them.
+ */
+#define DFU_HEADER_FLAG_COMPRESSED  (1 << 0)
+#define DFU_HEADER_FLAG_DELTA       (1 << 1)
+/* dfusmart holds the digest of each crypto chunk of the plaintext image,
+ * unchanged chunks are not written. Requires the image size. */
+#define DFU_HEADER_FLAG_DIGESTS     (1 << 2)
+
+/* options requiring the decrypted data to go through the staging buffer,
+ * mutually exclusive */
+#define DFU_HEADER_FLAGS_STAGED     (DFU_HEADER_FLAG_COMPRESSED | DFU_HEADER_FLAG_DELTA)
+
+#ifdef CONFIG_APP_DFUCRYPTO_DECOMP
+# define DFU_HEADER_DECOMP_SUPPORTED DFU_HEADER_FLAG_COMPRESSED
+#else
+# define DFU_HEADER_DECOMP_SUPPORTED 0
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_DELTA
+# define DFU_HEADER_DELTA_SUPPORTED DFU_HEADER_FLAG_DELTA
+#else
+# define DFU_HEADER_DELTA_SUPPORTED 0
+#endif
+#ifdef CONFIG_APP_DFUCRYPTO_SKIP_UNCHANGED
+# define DFU_HEADER_DIGESTS_SUPPORTED DFU_HEADER_FLAG_DIGESTS
+#else
+# define DFU_HEADER_DIGESTS_SUPPORTED 0
+#endif
+#define DFU_HEADER_FLAGS_SUPPORTED  (DFU_HEADER_DECOMP_SUPPORTED | DFU_HEADER_DELTA_SUPPORTED | \
+                                     DFU_HEADER_DIGESTS_SUPPORTED)
+
+#if defined(CONFIG_APP_DFUCRYPTO_DECOMP) || defined(CONFIG_APP_DFUCRYPTO_DELTA)
+# define DFUCRYPTO_STAGING 1
+#endif
+
+/*
+ * dfucrypto specific IPC magics, exchanged with the DFU peers on top of
+ * the ones defined in wookey_ipc.h. They are only known to the tasks of the
+ * DFU, which take them from here: their values are kept out of the range
+ * of wookey_ipc.h, and main.c fails to build if one collides with it.
+ */
+
+/* crypto -> dfuflash: erase the sectors covering the given image area
+ * (u32[0]: offset in the image, u32[1]: length). No response. */
+#define MAGIC_DFU_ERASE_AHEAD       0xe0
+/* crypto -> dfuflash: read the installed firmware into the flash SHM
+ * (u32[0]: offset in the firmware, u32[1]: offset in the SHM, u32[2]:
+ * length). dfuflash answers with the same magic and SYNC_DONE. */
+#define MAGIC_DFU_BANK_READ         0xe1
+/* crypto -> dfusmart: expected digest of a crypto chunk (u32[0]: chunk
+ * index). dfusmart answers with the same magic, SYNC_DONE and the 32 bytes
+ * digest in u8[], or SYNC_FAILURE if it has none. */
+#define MAGIC_DFU_CHUNK_DIGEST      0xe5
+/* crypto -> dfuflash: digest of the current content of the area the given
+ * image part is to be written to (u32[0]: offset in the image, u32[1]:
+ * length). dfuflash answers like dfusmart to MAGIC_DFU_CHUNK_DIGEST. */
+#define MAGIC_DFU_FLASH_DIGEST      0xe6
+/* crypto -> dfuflash: the given image part (u32[0]: offset, u32[1]: length),
+ * made of whole flash sectors, is already installed and will not be sent.
+ * No response. */
+#define MAGIC_DFU_FLASH_SKIP        0xe7
+/* crypto -> dfuflash: flash sector holding the given image offset (u32[0]).
+ * dfuflash answers with the same magic, SYNC_DONE, and the sector start
+ * offset in the image in u32[0] and its size in u32[1], or SYNC_FAILURE. */
+#define MAGIC_DFU_FLASH_SECTOR      0xe8
+
 #endif
@@ -0,0 +1,148 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "libc/syscall.h"
+#include "perf.h"
+
+#ifdef CONFIG_APP_DFUCRYPTO_PERF
+
+static const char *perf_stage_names[PERF_STAGE_MAX] = {
+    "usb wait",
+    "key inject",
+    "cryp dma",
+    "flash write",
+    "usb ack",
+};
+
+typedef struct {
+    uint64_t total[PERF_STAGE_MAX];
+    uint64_t max[PERF_STAGE_MAX];
+    uint32_t count[PERF_STAGE_MAX];
+    uint32_t transfers;
+    uint32_t retries;
+    uint32_t bytes;
+    uint64_t start;
+} perf_ctx_t;
+
+/* image being transferred */
+static perf_ctx_t perf_ctx;
+/* image being flushed by dfuflash, reported once it is written */
+static perf_ctx_t perf_flushed;
+
+/* All the timings are in microseconds */
+uint64_t perf_now(void)
+{
+    uint64_t now = 0;
+
+    if (sys_get_systick(&now, PREC_MICRO) != SYS_E_DONE) {
+        return 0;
+    }
+    return now;
+}
+
+void perf_reset(void)
+{
+    memset(&perf_ctx, 0, sizeof(perf_ctx));
+    perf_ctx.start = perf_now();
+}
+
+void perf_freeze(void)
+{
+    perf_flushed = perf_ctx;
+}
+
+void perf_account(perf_stage_t stage, uint64_t start)
+{
+    uint64_t delta = perf_now() - start;
+
+    if (stage >= PERF_STAGE_MAX) {
+        return;
+    }
+    perf_ctx.total[stage] += delta;
+    perf_ctx.count[stage]++;
+    if (delta > perf_ctx.max[stage]) {
+        perf_ctx.max[stage] = delta;
+    }
+}
+
+void perf_add_transfer(uint32_t bytes, bool dma_retry)
+{
+    if (dma_retry) {
+        perf_ctx.retries++;
+        return;
+    }
+    perf_ctx.transfers++;
+    perf_ctx.bytes += bytes;
+}
+
+void perf_report(uint16_t usb_chunk_size, uint16_t flash_chunk_size,
+                 uint16_t crypto_chunk_size)
+{
+    uint64_t elapsed = perf_now() - perf_flushed.start;
+    uint64_t accounted = 0;
+    uint8_t critical = PERF_STAGE_USB_WAIT;
+
+    for (uint8_t i = 0; i < PERF_STAGE_MAX; ++i) {
+        accounted += perf_flushed.total[i];
+        if (perf_flushed.total[i] > perf_flushed.total[critical]) {
+            critical = i;
+        }
+    }
+    if (accounted == 0) {
+        return;
+    }
+
+    printf("[perf] geometry: usb %d, flash %d, crypto %d\n",
+            usb_chunk_size, flash_chunk_size, crypto_chunk_size);
+    printf("[perf] %d bytes in %d transfers (%d DMA retries), %d us\n",
+            perf_flushed.bytes, perf_flushed.transfers, perf_flushed.retries, (uint32_t)elapsed);
+    if (elapsed != 0) {
+        printf("[perf] throughput: %d bytes/s\n",
+                (uint32_t)(((uint64_t)perf_flushed.bytes * 1000000) / elapsed));
+    }
+    for (uint8_t i = 0; i < PERF_STAGE_MAX; ++i) {
+        if (perf_flushed.count[i] == 0) {
+            continue;
+        }
+        printf("[perf] %s: %d us (%d%%), %d calls, avg %d us, max %d us\n",
+                perf_stage_names[i], (uint32_t)perf_flushed.total[i],
+                (uint32_t)((perf_flushed.total[i] * 100) / accounted),
+                perf_flushed.count[i],
+                (uint32_t)(perf_flushed.total[i] / perf_flushed.count[i]),
+                (uint32_t)perf_flushed.max[i]);
+    }
+    /* The write automaton is fully serialized: the stage holding the
+     * biggest share of the time is the one bounding the DFU throughput */
+    printf("[perf] critical path: %s\n", perf_stage_names[critical]);
+}
+
+/* time from INIT_DONE to the end of the startup handshake with the peers */
+void perf_report_startup(uint64_t start)
+{
+    printf("[perf] startup handshake: %d us\n", (uint32_t)(perf_now() - start));
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+#ifndef PERF_H_
+#define PERF_H_
+
+#include "libc/types.h"
+#include "autoconf.h"
+
+/*
+ * Data plane profiling. Each stage of the write automaton is accounted
+ * separately so that the DFU time can be broken down per peer (host/USB,
+ * dfusmart, CRYP, dfuflash) for the chunk geometry currently configured.
+ */
+typedef enum {
+    PERF_STAGE_USB_WAIT = 0,    /* waiting for the next request from dfuusb */
+    PERF_STAGE_KEY_INJECT,      /* key reinjection by dfusmart */
+    PERF_STAGE_CRYP_DMA,        /* CRYP DMA decryption */
+    PERF_STAGE_FLASH_WRITE,     /* dfuflash write request and ack */
+    PERF_STAGE_USB_ACK,         /* write ack back to dfuusb */
+    PERF_STAGE_MAX
+} perf_stage_t;
+
+#ifdef CONFIG_APP_DFUCRYPTO_PERF
+
+uint64_t perf_now(void);
+
+void perf_reset(void);
+
+void perf_account(perf_stage_t stage, uint64_t start);
+
+void perf_add_transfer(uint32_t bytes, bool dma_retry);
+
+/*
+ * Keep the figures of the current image aside when dfuflash starts flushing
+ * it, as the next image may start before the report.
+ */
+void perf_freeze(void);
+
+/* Report the figures of the last frozen image */
+void perf_report(uint16_t usb_chunk_size, uint16_t flash_chunk_size,
+                 uint16_t crypto_chunk_size);
+
+void perf_report_startup(uint64_t start);
+
+#else
+
+static inline uint64_t perf_now(void) { return 0; }
+
+static inline void perf_reset(void) { }
+
+static inline void perf_freeze(void) { }
+
+static inline void perf_account(perf_stage_t stage __attribute__((unused)),
+                                uint64_t start __attribute__((unused))) { }
+
+static inline void perf_add_transfer(uint32_t bytes __attribute__((unused)),
+                                     bool dma_retry __attribute__((unused))) { }
+
+static inline void perf_report(uint16_t usb_chunk_size __attribute__((unused)),
+                               uint16_t flash_chunk_size __attribute__((unused)),
+                               uint16_t crypto_chunk_size __attribute__((unused))) { }
+
+static inline void perf_report_startup(uint64_t start __attribute__((unused))) { }
+
+#endif
+
+#endif
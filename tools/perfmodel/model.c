@@ -0,0 +1,937 @@
+/*
+ *
+ * Copyright 2019 The wookey project team <wookey@ssi.gouv.fr>
+ *   - Ryad     Benadjila
+ *   - Arnauld  Michelizza
+ *   - Mathieu  Renard
+ *   - Philippe Thierry
+ *   - Philippe Trebuchet
+ *
+ * This package is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * ur option) any later version.
+ *
+ * This package is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ * PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this package; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ *
+ */
+
+/*
+ * Host model of the dfucrypto write data path.
+ *
+ * The task sources are built for the host against stubs of the EwoK syscalls
+ * and of the CRYP driver, and run against simulated dfusmart, pin, dfuusb and
+ * dfuflash tasks on a simulated clock. Each run downloads one image with a
+ * given transfer size and crypto chunk size, and the sweep prints, for each
+ * geometry, the DFU time and where dfucrypto spends it.
+ *
+ * The default timings below are assumptions, not measures: the figures are
+ * only meaningful relative to each other until the timings are set (-T) from
+ * the on-target reports of CONFIG_APP_DFUCRYPTO_PERF. The CRYP DMA can also
+ * be made to fail (-e), to run the retry path of the task.
+ *
+ * The model also checks the task behaviour: the written data is checked
+ * against the plaintext image, and sending to a peer which is blocked
+ * sending to dfucrypto, or waiting for a message no peer will send, ends the
+ * run as an IPC deadlock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "libc/syscall.h"
+#include "libcryp.h"
+#include "wookey_ipc.h"
+#include "main.h"
+
+int _main(uint32_t task_id);
+
+/* Peers and hardware timings, in us unless told otherwise */
+enum {
+    T_IPC = 0,
+    T_SYSTICK,
+    T_SMART_INIT,
+    T_USB_INIT,
+    T_FLASH_INIT,
+    T_PIN_INIT,
+    T_KEY_INJECT_INIT,
+    T_PIN_CONFIRM,
+    T_PEER_RELEASE,
+    T_HOST_START,
+    T_HEADER_CHECK,
+    T_KEY_INJECT,
+    T_USB_REQUEST,
+    USB_NS_PER_BYTE,
+    T_CRYP_SETUP,
+    CRYP_NS_PER_BYTE,
+    T_SECTOR_ERASE,
+    FLASH_NS_PER_BYTE,
+    T_FLASH_FINISH,
+    TIMING_MAX
+};
+
+static struct {
+    const char *name;
+    uint32_t value;
+    const char *what;
+} timings[TIMING_MAX] = {
+    [T_IPC]             = { "T_IPC", 10, "IPC_SEND_SYNC, with the context switches" },
+    [T_SYSTICK]         = { "T_SYSTICK", 1, "sys_get_systick" },
+    [T_SMART_INIT]      = { "T_SMART_INIT", 50000, "dfusmart init, until its READY" },
+    [T_USB_INIT]        = { "T_USB_INIT", 300000, "dfuusb init, until its READY" },
+    [T_FLASH_INIT]      = { "T_FLASH_INIT", 20000, "dfuflash init, until its READY" },
+    [T_PIN_INIT]        = { "T_PIN_INIT", 10000, "pin init, until its READY" },
+    [T_KEY_INJECT_INIT] = { "T_KEY_INJECT_INIT", 1500000, "first key injection, with the user authentication" },
+    [T_PIN_CONFIRM]     = { "T_PIN_CONFIRM", 1000, "pin confirmation of the authentication state" },
+    [T_PEER_RELEASE]    = { "T_PEER_RELEASE", 100, "dfuusb/dfuflash end_of_cryp response" },
+    [T_HOST_START]      = { "T_HOST_START", 1000, "host DFU_DNLOAD of the header, after the startup" },
+    [T_HEADER_CHECK]    = { "T_HEADER_CHECK", 20000, "header signature check by dfusmart" },
+    [T_KEY_INJECT]      = { "T_KEY_INJECT", 1500, "key derivation and injection, per crypto chunk" },
+    [T_USB_REQUEST]     = { "T_USB_REQUEST", 1000, "DFU_DNLOAD and DFU_GETSTATUS polling, per transfer" },
+    [USB_NS_PER_BYTE]   = { "USB_NS_PER_BYTE", 1000, "ns, ~1 MB/s of control transfers" },
+    [T_CRYP_SETUP]      = { "T_CRYP_SETUP", 5, "CRYP and DMA streams configuration" },
+    [CRYP_NS_PER_BYTE]  = { "CRYP_NS_PER_BYTE", 20, "ns, ~50 MB/s through the CRYP" },
+    [T_SECTOR_ERASE]    = { "T_SECTOR_ERASE", 1000000, "128 KB sector erase" },
+    [FLASH_NS_PER_BYTE] = { "FLASH_NS_PER_BYTE", 4000, "ns, 16 us per programmed 32 bits word" },
+    [T_FLASH_FINISH]    = { "T_FLASH_FINISH", 2000, "image trailer, once the data is written" },
+};
+
+#define TIMING(t)           ((uint64_t)timings[t].value)
+
+#define FLASH_SECTOR_SIZE   (128 * 1024)
+#define FLASH_SECTORS_MAX   64
+#define FLASH_SHM_SIZE      4096
+#define CRYP_SEED           1
+#define DEFAULT_IMAGE_SIZE  (256 * 1024)
+
+#define US(t)               (TIMING(t) * 1000)
+
+#ifndef MODEL_FEATURES
+# define MODEL_FEATURES ""
+#endif
+
+enum {
+    PEER_SMART = 1,
+    PEER_PIN,
+    PEER_FLASH,
+    PEER_USB,
+    PEER_CRYPTO
+};
+
+/* where the time of dfucrypto goes */
+enum {
+    ACC_USB = 0,
+    ACC_SMART,
+    ACC_CRYP,
+    ACC_FLASH,
+    ACC_CPU,
+    ACC_MAX
+};
+
+static const char *acc_names[ACC_MAX] = { "usb", "key", "cryp", "flash", "cpu" };
+
+/* must match the layout used by dfucrypto */
+struct dmashm_info {
+    uint32_t addr;
+    uint16_t size;
+};
+
+/* message a peer is blocked sending to dfucrypto, from the ready time on */
+typedef struct {
+    uint64_t ready;
+    uint8_t from;
+    bool shm_info;
+    logsize_t size;
+    uint8_t buf[sizeof(t_ipc_command)];
+} model_msg_t;
+
+#define QUEUE_MAX 16
+
+static struct {
+    uint32_t image_size;
+    uint32_t transfer_size;
+    uint32_t chunk_size;
+    uint32_t flash_shm_size;
+    /* probability of a CRYP DMA FIFO error, per DMA */
+    double dma_error_rate;
+    uint32_t seed;
+    bool verbose;
+    bool startup_only;
+    /* dfusmart got the WRITE_FINISHED of the image */
+    bool finished;
+} run;
+
+static uint64_t now;
+static uint64_t acc[ACC_MAX];
+static bool measuring;
+static uint64_t image_start;
+static uint8_t shm_infos;
+
+static model_msg_t queue[QUEUE_MAX];
+static uint8_t queue_len;
+
+static uint8_t *usb_shm;
+static uint8_t *flash_shm;
+
+static struct {
+    bool startup_done;
+    uint32_t key;
+} smart;
+
+static struct {
+    uint32_t sent;
+    uint32_t in_flight;
+} usb;
+
+static struct {
+    uint64_t busy_until;
+    uint32_t written;
+    uint32_t errors;
+    bool erased[FLASH_SECTORS_MAX];
+} flash;
+
+static struct {
+    cryp_handler_t in_handler;
+    cryp_handler_t out_handler;
+    uint32_t block;
+    bool busy;
+    uint64_t done;
+    uint8_t *out;
+    uint32_t len;
+    uint32_t errors;
+} cryp;
+
+/*
+ * Plaintext image and keystream patterns. The key changes on each crypto
+ * chunk, and the CTR counter restarts on each of them.
+ */
+static uint8_t plain_byte(uint32_t offset)
+{
+    return (uint8_t)(offset * 31 + (offset >> 8));
+}
+
+static uint8_t keystream_byte(uint32_t key, uint32_t block, uint32_t i)
+{
+    return (uint8_t)(key * 131 + block * 7 + i * 13 + 0x5a);
+}
+
+/* xorshift32, the runs of a sweep draw the same errors */
+static uint32_t model_rand(void)
+{
+    run.seed ^= run.seed << 13;
+    run.seed ^= run.seed >> 17;
+    run.seed ^= run.seed << 5;
+    return run.seed;
+}
+
+static void model_exit(int status)
+{
+    fflush(stdout);
+    _exit(status);
+}
+
+static void model_fail(const char *fmt, ...)
+{
+    va_list args;
+
+    printf("%8u %8u %6u | ", run.transfer_size, run.chunk_size, run.flash_shm_size);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    model_exit(1);
+}
+
+int model_printf(const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    if (run.verbose == false) {
+        return 0;
+    }
+    printf("    ");
+    va_start(args, fmt);
+    ret = vprintf(fmt, args);
+    va_end(args);
+    return ret;
+}
+
+/* The CRYP DMA completes in the background, its interrupts are raised as
+ * soon as the clock reaches its end. A failed DMA leaves a corrupted output,
+ * which the task has to produce again. */
+static void cryp_tick(void)
+{
+    if (cryp.busy && (now >= cryp.done)) {
+        cryp.busy = false;
+        cryp.in_handler(0, DMA_TRANSFER);
+        if ((run.dma_error_rate > 0) && (model_rand() < run.dma_error_rate * UINT32_MAX)) {
+            cryp.errors++;
+            for (uint32_t i = 0; i < cryp.len; ++i) {
+                cryp.out[i] = ~cryp.out[i];
+            }
+            cryp.out_handler(0, DMA_FIFO_ERROR);
+            return;
+        }
+        cryp.out_handler(0, DMA_TRANSFER);
+    }
+}
+
+static void advance(uint64_t to, uint8_t who)
+{
+    if (to > now) {
+        if (measuring) {
+            acc[who] += to - now;
+        }
+        now = to;
+    }
+    cryp_tick();
+}
+
+static uint8_t peer_acc(uint8_t peer)
+{
+    switch (peer) {
+        case PEER_USB:
+            return ACC_USB;
+        case PEER_FLASH:
+            return ACC_FLASH;
+        default:
+            return ACC_SMART;
+    }
+}
+
+static void queue_push(uint8_t from, uint64_t ready, const void *buf, logsize_t size)
+{
+    if (queue_len == QUEUE_MAX) {
+        model_fail("model message queue overflow");
+    }
+    queue[queue_len].ready = ready;
+    queue[queue_len].from = from;
+    queue[queue_len].shm_info = false;
+    queue[queue_len].size = size;
+    memcpy(queue[queue_len].buf, buf, size);
+    queue_len++;
+}
+
+static void push_cmd(uint8_t from, uint64_t ready, uint8_t magic, uint8_t state)
+{
+    struct sync_command cmd = { .magic = magic, .state = state };
+
+    queue_push(from, ready, &cmd, sizeof(cmd));
+}
+
+static void push_shm_info(uint8_t from, uint64_t ready, const uint8_t *shm, uint16_t size)
+{
+    struct dmashm_info info = { .addr = (uint32_t)(uintptr_t)shm, .size = size };
+
+    queue_push(from, ready, &info, sizeof(info));
+    queue[queue_len - 1].shm_info = true;
+}
+
+static uint64_t usb_transfer_time(uint32_t len)
+{
+    return US(T_USB_REQUEST) + len * TIMING(USB_NS_PER_BYTE);
+}
+
+/* the host sends the next transfer, encrypted, in the dfuusb DMA SHM */
+static void usb_send_next(void)
+{
+    struct sync_command_data req = { 0 };
+    uint32_t len = run.image_size - usb.sent;
+
+    if (len > run.transfer_size) {
+        len = run.transfer_size;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        uint32_t offset = usb.sent + i;
+        uint32_t in_chunk = offset % run.chunk_size;
+
+        usb_shm[i] = plain_byte(offset) ^
+                     keystream_byte(offset / run.chunk_size, in_chunk / 16, in_chunk % 16);
+    }
+    usb.in_flight = len;
+    req.magic = MAGIC_DATA_WR_DMA_REQ;
+    req.state = SYNC_WAIT;
+    req.data_size = sizeof(uint16_t);
+    req.data.u16[0] = len;
+    queue_push(PEER_USB, now + usb_transfer_time(len), &req, sizeof(req));
+}
+
+static void flash_erase(uint32_t offset, uint32_t len)
+{
+    for (uint32_t s = offset / FLASH_SECTOR_SIZE; s * FLASH_SECTOR_SIZE < offset + len; ++s) {
+        if (s >= FLASH_SECTORS_MAX) {
+            model_fail("image overflows the modelled flash");
+        }
+        if (flash.erased[s] == false) {
+            flash.busy_until += US(T_SECTOR_ERASE);
+            flash.erased[s] = true;
+        }
+    }
+}
+
+static void flash_write(uint16_t len)
+{
+    struct sync_command_data ack = { 0 };
+
+    for (uint32_t i = 0; i < len; ++i) {
+        if (flash_shm[i] != plain_byte(flash.written + i)) {
+            flash.errors++;
+        }
+    }
+    if (flash.busy_until < now) {
+        flash.busy_until = now;
+    }
+    flash_erase(flash.written, len);
+    flash.busy_until += len * TIMING(FLASH_NS_PER_BYTE);
+    flash.written += len;
+    ack.magic = MAGIC_DATA_WR_DMA_ACK;
+    ack.state = SYNC_DONE;
+    ack.data_size = sizeof(uint16_t);
+    ack.data.u16[0] = len;
+    queue_push(PEER_FLASH, flash.busy_until, &ack, sizeof(ack));
+}
+
+static void run_report(void)
+{
+    uint64_t total = now - image_start;
+    uint8_t critical = ACC_USB;
+
+    if (flash.errors != 0) {
+        model_fail("%u corrupted bytes written", flash.errors);
+    }
+    if (flash.written != run.image_size) {
+        model_fail("%u bytes written out of %u", flash.written, run.image_size);
+    }
+    for (uint8_t i = 0; i < ACC_MAX; ++i) {
+        if (acc[i] > acc[critical]) {
+            critical = i;
+        }
+    }
+    printf("%8u %8u %6u | %9.1f %8.1f |", run.transfer_size, run.chunk_size,
+           run.flash_shm_size, total / 1e6, (run.image_size / 1024.0) / (total / 1e9));
+    for (uint8_t i = 0; i < ACC_MAX; ++i) {
+        printf(" %5.1f", (acc[i] * 100.0) / total);
+    }
+    printf(" | %8s %6u\n", acc_names[critical], cryp.errors);
+    model_exit(0);
+}
+
+static void smart_receive(const t_ipc_command *msg)
+{
+    struct sync_command_data resp = { 0 };
+
+    switch (msg->magic) {
+        case MAGIC_TASK_STATE_RESP:
+            break;
+        case MAGIC_CRYPTO_INJECT_CMD:
+            if (cryp.busy) {
+                model_fail("key replaced during a CRYP DMA");
+            }
+            if (smart.startup_done == false) {
+                smart.startup_done = true;
+                push_cmd(PEER_SMART, now + US(T_KEY_INJECT_INIT), MAGIC_CRYPTO_INJECT_RESP, SYNC_DONE);
+                break;
+            }
+            smart.key++;
+            push_cmd(PEER_SMART, now + US(T_KEY_INJECT), MAGIC_CRYPTO_INJECT_RESP, SYNC_DONE);
+            break;
+        case MAGIC_DFU_HEADER_SEND:
+            /* the key of the first crypto chunk is injected with the check */
+            smart.key = 0;
+            resp.magic = MAGIC_DFU_HEADER_VALID;
+            resp.state = SYNC_DONE;
+            resp.data_size = 3 * sizeof(uint32_t);
+            resp.data.u16[0] = run.chunk_size;
+            resp.data.u32[1] = run.image_size;
+            resp.data.u32[2] = 0;
+            queue_push(PEER_SMART, now + US(T_HEADER_CHECK), &resp, sizeof(resp));
+            break;
+        case MAGIC_DFU_WRITE_FINISHED:
+            /* reported once dfucrypto waits again, after its own report */
+            run.finished = true;
+            break;
+        case MAGIC_REBOOT_REQUEST:
+            model_fail("reboot requested by dfucrypto");
+            break;
+        default:
+            model_fail("dfusmart: unexpected magic %x", msg->magic);
+    }
+}
+
+static void pin_receive(const t_ipc_command *msg)
+{
+    switch (msg->magic) {
+        case MAGIC_TASK_STATE_RESP:
+            break;
+        case MAGIC_AUTH_STATE_PASSED:
+            push_cmd(PEER_PIN, now + US(T_PIN_CONFIRM), MAGIC_AUTH_STATE_PASSED, SYNC_ACKNOWLEDGE);
+            break;
+        default:
+            model_fail("pin: unexpected magic %x", msg->magic);
+    }
+}
+
+static void usb_receive(const t_ipc_command *msg)
+{
+    struct sync_command_data header = { 0 };
+
+    switch (msg->magic) {
+        case MAGIC_TASK_STATE_RESP:
+            break;
+        case MAGIC_TASK_STATE_CMD:
+            push_cmd(PEER_USB, now + US(T_PEER_RELEASE), MAGIC_TASK_STATE_RESP, SYNC_READY);
+            push_shm_info(PEER_USB, now + 2 * US(T_PEER_RELEASE), usb_shm, run.transfer_size);
+            header.magic = MAGIC_DFU_HEADER_SEND;
+            header.state = SYNC_WAIT;
+            image_start = now + 2 * US(T_PEER_RELEASE) + US(T_HOST_START);
+            queue_push(PEER_USB, image_start, &header, sizeof(header));
+            break;
+        case MAGIC_DFU_HEADER_VALID:
+            usb_send_next();
+            break;
+        case MAGIC_DFU_HEADER_INVALID:
+            model_fail("image rejected");
+            break;
+        case MAGIC_DATA_WR_DMA_ACK:
+            if (msg->sync_cmd_data.state != SYNC_DONE) {
+                model_fail("write request failed");
+            }
+            usb.sent += usb.in_flight;
+            if (usb.sent < run.image_size) {
+                usb_send_next();
+            } else {
+                push_cmd(PEER_USB, now + US(T_USB_REQUEST), MAGIC_DFU_DWNLOAD_FINISHED, SYNC_DONE);
+            }
+            break;
+        default:
+            model_fail("dfuusb: unexpected magic %x", msg->magic);
+    }
+}
+
+static void flash_receive(const t_ipc_command *msg)
+{
+    struct sync_command_data sector = { 0 };
+
+    switch (msg->magic) {
+        case MAGIC_TASK_STATE_RESP:
+            break;
+        case MAGIC_TASK_STATE_CMD:
+            push_cmd(PEER_FLASH, now + US(T_PEER_RELEASE), MAGIC_TASK_STATE_RESP, SYNC_READY);
+            push_shm_info(PEER_FLASH, now + 2 * US(T_PEER_RELEASE), flash_shm, run.flash_shm_size);
+            break;
+        case MAGIC_DATA_WR_DMA_REQ:
+            flash_write(msg->sync_cmd_data.data.u16[0]);
+            break;
+        case MAGIC_DFU_ERASE_AHEAD:
+            /* erased while dfucrypto goes on */
+            if (flash.busy_until < now) {
+                flash.busy_until = now;
+            }
+            flash_erase(msg->sync_cmd_data.data.u32[0], msg->sync_cmd_data.data.u32[1]);
+            break;
+        case MAGIC_DFU_FLASH_SECTOR:
+            if (flash.busy_until < now) {
+                flash.busy_until = now;
+            }
+            sector.magic = MAGIC_DFU_FLASH_SECTOR;
+            sector.state = SYNC_DONE;
+            sector.data_size = 2 * sizeof(uint32_t);
+            sector.data.u32[0] = msg->sync_cmd_data.data.u32[0] - (msg->sync_cmd_data.data.u32[0] % FLASH_SECTOR_SIZE);
+            sector.data.u32[1] = FLASH_SECTOR_SIZE;
+            queue_push(PEER_FLASH, flash.busy_until, &sector, sizeof(sector));
+            break;
+        case MAGIC_DFU_DWNLOAD_FINISHED:
+            if (flash.busy_until < now) {
+                flash.busy_until = now;
+            }
+            push_cmd(PEER_FLASH, flash.busy_until + US(T_FLASH_FINISH), MAGIC_DFU_WRITE_FINISHED, SYNC_DONE);
+            break;
+        default:
+            model_fail("dfuflash: magic %x not modelled", msg->magic);
+    }
+}
+
+/*
+ * EwoK syscalls
+ */
+static e_syscall_ret ipc_send(uint8_t dest, logsize_t size, const char *buf)
+{
+    t_ipc_command msg;
+
+    /* a peer already blocked sending to us can't receive */
+    for (uint8_t i = 0; i < queue_len; ++i) {
+        if ((queue[i].from == dest) && (queue[i].ready <= now)) {
+            model_fail("IPC deadlock: send to task %d, blocked sending magic %x",
+                       dest, queue[i].buf[0]);
+        }
+    }
+    advance(now + US(T_IPC), ACC_CPU);
+    memset(&msg, 0, sizeof(msg));
+    memcpy(&msg, buf, (size < sizeof(msg)) ? size : sizeof(msg));
+    switch (dest) {
+        case PEER_SMART:
+            smart_receive(&msg);
+            break;
+        case PEER_PIN:
+            pin_receive(&msg);
+            break;
+        case PEER_USB:
+            usb_receive(&msg);
+            break;
+        case PEER_FLASH:
+            flash_receive(&msg);
+            break;
+        default:
+            model_fail("send to unknown task %d", dest);
+    }
+    return SYS_E_DONE;
+}
+
+static e_syscall_ret ipc_recv(uint8_t *from, logsize_t *size, char *buf)
+{
+    int8_t next = -1;
+    model_msg_t msg;
+
+    if (run.finished) {
+        run_report();
+    }
+    /* a task sends its messages one after the other: only the first
+     * queued message of each peer can be received */
+    for (uint8_t i = 0; i < queue_len; ++i) {
+        bool first = true;
+
+        for (uint8_t j = 0; j < i; ++j) {
+            first &= (queue[j].from != queue[i].from);
+        }
+        if (first && ((*from == ANY_APP) || (queue[i].from == *from)) &&
+            ((next < 0) || (queue[i].ready < queue[next].ready))) {
+            next = i;
+        }
+    }
+    if (next < 0) {
+        model_fail("IPC deadlock: waiting for task %d, which has nothing to send", *from);
+    }
+    msg = queue[next];
+    memmove(&queue[next], &queue[next + 1], (queue_len - next - 1) * sizeof(model_msg_t));
+    queue_len--;
+    if (msg.size > *size) {
+        model_fail("IPC message of %d bytes for a %d bytes buffer", msg.size, *size);
+    }
+    advance(msg.ready, peer_acc(msg.from));
+    /* the next message of the peer is sent from now on */
+    for (uint8_t i = next; i < queue_len; ++i) {
+        if ((queue[i].from == msg.from) && (queue[i].ready < now)) {
+            queue[i].ready = now;
+        }
+    }
+    if ((msg.from == PEER_USB) && (msg.buf[0] == MAGIC_DFU_HEADER_SEND)) {
+        measuring = true;
+    }
+    if (msg.shm_info && (++shm_infos == 2) && run.startup_only) {
+        printf("startup handshake: %.1f ms\n", now / 1e6);
+        model_exit(0);
+    }
+    *from = msg.from;
+    *size = msg.size;
+    memcpy(buf, msg.buf, msg.size);
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_ipc(int kind, ...)
+{
+    e_syscall_ret ret = SYS_E_INVAL;
+    va_list args;
+
+    va_start(args, kind);
+    if (kind == IPC_SEND_SYNC) {
+        uint8_t dest = (uint8_t)va_arg(args, int);
+        logsize_t size = (logsize_t)va_arg(args, int);
+
+        ret = ipc_send(dest, size, va_arg(args, const char *));
+    } else if (kind == IPC_RECV_SYNC) {
+        uint8_t *from = va_arg(args, uint8_t *);
+        logsize_t *size = va_arg(args, logsize_t *);
+
+        ret = ipc_recv(from, size, va_arg(args, char *));
+    }
+    va_end(args);
+    return ret;
+}
+
+e_syscall_ret sys_init(int kind, ...)
+{
+    static const char *names[] = { NULL, "dfusmart", "pin", "dfuflash", "dfuusb" };
+    va_list args;
+
+    va_start(args, kind);
+    if (kind == INIT_GETTASKID) {
+        const char *name = va_arg(args, const char *);
+        uint8_t *id = va_arg(args, uint8_t *);
+
+        for (uint8_t i = PEER_SMART; i <= PEER_USB; ++i) {
+            if (strcmp(name, names[i]) == 0) {
+                *id = i;
+            }
+        }
+    }
+    va_end(args);
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_get_systick(uint64_t *val, int prec)
+{
+    advance(now + US(T_SYSTICK), cryp.busy ? ACC_CRYP : ACC_CPU);
+    switch (prec) {
+        case PREC_MILLI:
+            *val = now / 1000000;
+            break;
+        case PREC_MICRO:
+            *val = now / 1000;
+            break;
+        default:
+            *val = (now * 168) / 1000;
+    }
+    return SYS_E_DONE;
+}
+
+e_syscall_ret sys_yield(void)
+{
+    model_fail("dfucrypto stopped on error");
+    return SYS_E_DONE;
+}
+
+/*
+ * CRYP driver
+ */
+void cryp_early_init(bool with_dma __attribute__((unused)), int map_mode __attribute__((unused)),
+                     int user __attribute__((unused)), int *dma_in_desc, int *dma_out_desc)
+{
+    *dma_in_desc = 1;
+    *dma_out_desc = 2;
+}
+
+void cryp_init_dma(cryp_handler_t in_handler, cryp_handler_t out_handler,
+                   uint32_t dma_in_desc __attribute__((unused)),
+                   uint32_t dma_out_desc __attribute__((unused)))
+{
+    cryp.in_handler = in_handler;
+    cryp.out_handler = out_handler;
+}
+
+void cryp_init_user(int key_size __attribute__((unused)), const uint8_t *iv,
+                    uint32_t iv_len __attribute__((unused)),
+                    int mode __attribute__((unused)), int dir __attribute__((unused)))
+{
+    if (cryp.busy) {
+        model_fail("CRYP configured during a DMA");
+    }
+    cryp.block = ((uint32_t)iv[12] << 24) | ((uint32_t)iv[13] << 16) |
+                 ((uint32_t)iv[14] << 8) | iv[15];
+}
+
+void cryp_do_dma(const uint8_t *in, const uint8_t *out, uint32_t len,
+                 uint32_t dma_in_desc __attribute__((unused)),
+                 uint32_t dma_out_desc __attribute__((unused)))
+{
+    uint8_t *dst = (uint8_t *)out;
+
+    if (cryp.busy) {
+        model_fail("CRYP DMA started during a DMA");
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        dst[i] = in[i] ^ keystream_byte(smart.key, cryp.block + (i / 16), i % 16);
+    }
+    cryp.block += len / 16;
+    cryp.busy = true;
+    cryp.out = dst;
+    cryp.len = len;
+    cryp.done = now + US(T_CRYP_SETUP) + len * TIMING(CRYP_NS_PER_BYTE);
+}
+
+void cryp_flush_fifos(void)
+{
+}
+
+void cryp_wait_for_emtpy_fifos(void)
+{
+}
+
+/* DMA SHM addresses are exchanged as 32 bits values */
+static uint8_t *shm_alloc(uint32_t size)
+{
+    void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE,
+#ifdef MAP_32BIT
+                     MAP_32BIT |
+#endif
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if ((shm == MAP_FAILED) || ((uintptr_t)shm > UINT32_MAX)) {
+        fprintf(stderr, "unable to map a DMA SHM below 4 GB\n");
+        exit(EXIT_FAILURE);
+    }
+    return shm;
+}
+
+/* Download the image with the given geometry, in a process of its own */
+static void model_run(uint32_t transfer_size, uint32_t chunk_size, uint32_t flash_shm_size)
+{
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        run.transfer_size = transfer_size;
+        run.chunk_size = chunk_size;
+        run.flash_shm_size = flash_shm_size;
+        usb_shm = shm_alloc(transfer_size);
+        flash_shm = shm_alloc(flash_shm_size);
+        push_cmd(PEER_SMART, US(T_SMART_INIT), MAGIC_TASK_STATE_CMD, SYNC_READY);
+        push_cmd(PEER_USB, US(T_USB_INIT), MAGIC_TASK_STATE_CMD, SYNC_READY);
+        push_cmd(PEER_FLASH, US(T_FLASH_INIT), MAGIC_TASK_STATE_CMD, SYNC_READY);
+        push_cmd(PEER_PIN, US(T_PIN_INIT), MAGIC_TASK_STATE_CMD, SYNC_READY);
+        _main(PEER_CRYPTO);
+        model_fail("dfucrypto returned");
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    if (WIFSIGNALED(status)) {
+        printf("%8u %8u %6u | crashed (signal %d)\n", transfer_size, chunk_size, flash_shm_size,
+               WTERMSIG(status));
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-i image_kb] [-t transfer_size] [-c crypto_chunk_size]\n"
+            "          [-f flash_shm_size] [-e dma_error_rate] [-s seed] [-T timing=value]...\n"
+            "timings, in us unless told otherwise:\n", name);
+    for (uint8_t i = 0; i < TIMING_MAX; ++i) {
+        fprintf(stderr, "  %-18s %8u  %s\n", timings[i].name, timings[i].value, timings[i].what);
+    }
+    exit(EXIT_FAILURE);
+}
+
+/* -T name=value */
+static bool timing_set(const char *arg)
+{
+    const char *value = strchr(arg, '=');
+
+    if (value == NULL) {
+        return false;
+    }
+    for (uint8_t i = 0; i < TIMING_MAX; ++i) {
+        if ((strncmp(arg, timings[i].name, value - arg) == 0) &&
+            (timings[i].name[value - arg] == '\0')) {
+            timings[i].value = strtoul(value + 1, NULL, 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    static uint32_t transfer_sizes[] = { 256, 512, 768, 1024, 2048, 4096 };
+    static uint32_t chunk_sizes[] = { 4096, 16384, 32768 };
+    static uint32_t flash_shm_sizes[] = { 1024, FLASH_SHM_SIZE };
+    uint32_t *transfers = transfer_sizes;
+    uint32_t *chunks = chunk_sizes;
+    uint32_t *flash_shms = flash_shm_sizes;
+    uint8_t ntransfers = sizeof(transfer_sizes) / sizeof(transfer_sizes[0]);
+    uint8_t nchunks = sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+    uint8_t nflash_shms = sizeof(flash_shm_sizes) / sizeof(flash_shm_sizes[0]);
+    uint32_t transfer_size;
+    uint32_t chunk_size;
+    uint32_t flash_shm_size;
+    bool verbose;
+    int opt;
+
+    run.image_size = DEFAULT_IMAGE_SIZE;
+    run.seed = CRYP_SEED;
+    while ((opt = getopt(argc, argv, "vi:t:c:f:e:s:T:")) != -1) {
+        switch (opt) {
+            case 'v':
+                run.verbose = true;
+                break;
+            case 'i':
+                run.image_size = strtoul(optarg, NULL, 0) * 1024;
+                break;
+            case 't':
+                /* a single geometry instead of the sweep */
+                transfer_size = strtoul(optarg, NULL, 0);
+                transfers = &transfer_size;
+                ntransfers = 1;
+                break;
+            case 'c':
+                chunk_size = strtoul(optarg, NULL, 0);
+                chunks = &chunk_size;
+                nchunks = 1;
+                break;
+            case 'f':
+                flash_shm_size = strtoul(optarg, NULL, 0);
+                flash_shms = &flash_shm_size;
+                nflash_shms = 1;
+                break;
+            case 'e':
+                run.dma_error_rate = strtod(optarg, NULL);
+                break;
+            case 's':
+                run.seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'T':
+                if (timing_set(optarg) == false) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if ((run.image_size == 0) || (run.image_size > FLASH_SECTORS_MAX * FLASH_SECTOR_SIZE) ||
+        (run.seed == 0) || (run.dma_error_rate < 0) || (run.dma_error_rate > 1)) {
+        usage(argv[0]);
+    }
+
+    printf("dfucrypto host model, features: %s, image %u KB, DMA error rate %g\n",
+           MODEL_FEATURES, run.image_size / 1024, run.dma_error_rate);
+    verbose = run.verbose;
+    run.verbose = false;
+    run.startup_only = true;
+    model_run(FLASH_SHM_SIZE, chunk_sizes[0], FLASH_SHM_SIZE);
+    run.startup_only = false;
+    run.verbose = verbose;
+
+    printf("transfer    chunk  flash |   time ms     KB/s |");
+    for (uint8_t i = 0; i < ACC_MAX; ++i) {
+        printf(" %5s", acc_names[i]);
+    }
+    printf(" | critical dma err\n");
+    for (uint8_t f = 0; f < nflash_shms; ++f) {
+        for (uint8_t t = 0; t < ntransfers; ++t) {
+            for (uint8_t c = 0; c < nchunks; ++c) {
+                model_run(transfers[t], chunks[c], flash_shms[f]);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * Configuration of the model build: the options are enabled with the
+ * FEATURES variable of the Makefile, their values default here.
+ */
+#ifndef AUTOCONF_H_
+#define AUTOCONF_H_
+
+#ifndef CONFIG_APP_DFUCRYPTO_ERASE_AHEAD_SECTORS
+# define CONFIG_APP_DFUCRYPTO_ERASE_AHEAD_SECTORS 1
+#endif
+#ifndef CONFIG_APP_DFUCRYPTO_STAGE_BUFSIZE
+# define CONFIG_APP_DFUCRYPTO_STAGE_BUFSIZE 4096
+#endif
+#ifndef CONFIG_APP_DFUCRYPTO_DECOMP_WINDOW_BITS
+# define CONFIG_APP_DFUCRYPTO_DECOMP_WINDOW_BITS 10
+#endif
+#ifndef CONFIG_APP_DFUCRYPTO_DECOMP_LOOKAHEAD_BITS
+# define CONFIG_APP_DFUCRYPTO_DECOMP_LOOKAHEAD_BITS 4
+#endif
+
+#endif
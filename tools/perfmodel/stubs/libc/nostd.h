@@ -0,0 +1,3 @@
+#ifndef LIBC_NOSTD_H_
+#define LIBC_NOSTD_H_
+#endif
@@ -0,0 +1,3 @@
+#ifndef LIBC_REGUTILS_H_
+#define LIBC_REGUTILS_H_
+#endif
@@ -0,0 +1,9 @@
+/* the task output goes through the model, which only shows it with -v */
+#ifndef LIBC_STDIO_H_
+#define LIBC_STDIO_H_
+
+int model_printf(const char *fmt, ...);
+
+#define printf model_printf
+
+#endif
@@ -0,0 +1,40 @@
+/* EwoK syscalls, implemented by the model (see model.c) */
+#ifndef LIBC_SYSCALL_H_
+#define LIBC_SYSCALL_H_
+
+#include "libc/types.h"
+
+typedef enum {
+    SYS_E_DONE = 0,
+    SYS_E_INVAL,
+    SYS_E_DENIED,
+    SYS_E_BUSY
+} e_syscall_ret;
+
+enum { IPC_SEND_SYNC, IPC_RECV_SYNC, IPC_SEND_ASYNC, IPC_RECV_ASYNC };
+enum { INIT_DEVACCESS, INIT_DMA, INIT_DMA_SHM, INIT_GETTASKID, INIT_DONE };
+enum { PREC_MILLI, PREC_MICRO, PREC_CYCLE };
+
+#define ANY_APP 0xff
+
+#define DMA_FIFO_ERROR          (1 << 0)
+#define DMA_DIRECT_MODE_ERROR   (1 << 2)
+#define DMA_TRANSFER_ERROR      (1 << 3)
+#define DMA_HALF_TRANSFER       (1 << 4)
+#define DMA_TRANSFER            (1 << 5)
+
+typedef struct {
+    char name[16];
+    uint32_t address;
+    uint32_t size;
+    bool isr_ctx_only;
+    uint8_t irq_num;
+    uint8_t gpio_num;
+} device_t;
+
+e_syscall_ret sys_ipc(int kind, ...);
+e_syscall_ret sys_init(int kind, ...);
+e_syscall_ret sys_get_systick(uint64_t *val, int prec);
+e_syscall_ret sys_yield(void);
+
+#endif
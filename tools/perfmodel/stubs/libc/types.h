@@ -0,0 +1,10 @@
+#ifndef LIBC_TYPES_H_
+#define LIBC_TYPES_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint16_t logsize_t;
+
+#endif
@@ -0,0 +1,25 @@
+/* CRYP driver API, implemented by the model (see model.c) */
+#ifndef LIBCRYP_H_
+#define LIBCRYP_H_
+
+#include "libc/types.h"
+
+enum { CRYP_MAP_AUTO, CRYP_MAP_VOLUNTARY };
+enum { CRYP_USER, CRYP_CFG };
+enum { KEY_128, KEY_192, KEY_256 };
+enum { AES_ECB, AES_CBC, AES_CTR };
+enum { ENCRYPT, DECRYPT };
+enum { CRYP_PRODMODE };
+
+typedef void (*cryp_handler_t)(uint8_t irq, uint32_t status);
+
+void cryp_early_init(bool with_dma, int map_mode, int user, int *dma_in_desc, int *dma_out_desc);
+void cryp_init_dma(cryp_handler_t in_handler, cryp_handler_t out_handler,
+                   uint32_t dma_in_desc, uint32_t dma_out_desc);
+void cryp_init_user(int key_size, const uint8_t *iv, uint32_t iv_len, int mode, int dir);
+void cryp_do_dma(const uint8_t *in, const uint8_t *out, uint32_t len,
+                 uint32_t dma_in_desc, uint32_t dma_out_desc);
+void cryp_flush_fifos(void);
+void cryp_wait_for_emtpy_fifos(void);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+ * IPC structures shared by the DFU tasks. The magic values are local to the
+ * model, only their layout and names follow the SDK.
+ */
+#ifndef WOOKEY_IPC_H_
+#define WOOKEY_IPC_H_
+
+#include "libc/types.h"
+
+enum {
+    MAGIC_TASK_STATE_CMD = 1,
+    MAGIC_TASK_STATE_RESP,
+    MAGIC_CRYPTO_INJECT_CMD,
+    MAGIC_CRYPTO_INJECT_RESP,
+    MAGIC_AUTH_STATE_PASSED,
+    MAGIC_DATA_RD_DMA_REQ,
+    MAGIC_DATA_WR_DMA_REQ,
+    MAGIC_DATA_WR_DMA_ACK,
+    MAGIC_DFU_HEADER_SEND,
+    MAGIC_DFU_HEADER_VALID,
+    MAGIC_DFU_HEADER_INVALID,
+    MAGIC_DFU_DWNLOAD_FINISHED,
+    MAGIC_DFU_WRITE_FINISHED,
+    MAGIC_REBOOT_REQUEST,
+    MAGIC_INVALID
+};
+
+enum {
+    SYNC_READY = 0,
+    SYNC_WAIT,
+    SYNC_ACKNOWLEDGE,
+    SYNC_DONE,
+    SYNC_FAILURE
+};
+
+struct sync_command {
+    uint8_t magic;
+    uint8_t state;
+};
+
+struct sync_command_data {
+    uint8_t magic;
+    uint8_t state;
+    uint8_t data_size;
+    union {
+        uint8_t  u8[32];
+        uint16_t u16[16];
+        uint32_t u32[8];
+    } data;
+};
+
+typedef union {
+    uint8_t                  magic;
+    struct sync_command      sync_cmd;
+    struct sync_command_data sync_cmd_data;
+} t_ipc_command;
+
+#endif